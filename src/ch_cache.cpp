@@ -0,0 +1,317 @@
+#include <Rcpp.h>
+#include <unordered_map>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary columnar cache of the unique capture histories, frequencies, and group columns (dat_out in make_dat of Wen_MSCJS_re_3.R),
+// so they can be loaded without reading and aggregating mark_file_CH.csv. Compile with Rcpp::sourceCpp.
+//
+// Layout (little endian, with each section padded to 8 bytes so the values can be used in place from a memory map):
+//   header: magic "MSCJSCH\0", version (uint32), number of columns (uint32), number of rows (uint64), checksum of the rest (uint64)
+//   key: string identifying the data or arguments the cache was made from
+//   each column: name (string), kind (uint32), width of values in bytes (uint32), number of levels (uint32), levels (strings), values
+// where strings are a uint32 length followed by the characters. Integer codes (integer, factor, and character columns) are stored
+// in 1 byte if they are between 0 and 254 (255 is NA), otherwise in 4 bytes.
+
+const char ch_cache_magic[8] = {'M','S','C','J','S','C','H','\0'};
+const uint32_t ch_cache_version = 1;
+const size_t ch_cache_header = 32;
+
+//kinds of columns
+enum cache_kind {
+  integer_col = 0,
+  double_col = 1,
+  factor_col = 2,
+  character_col = 3  // stored as a factor
+};
+
+//64 bit FNV-1a checksum
+uint64_t cache_checksum(const unsigned char *x, size_t n){
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i=0; i<n; i++){
+    h ^= x[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//function that returns the FNV-1a hash of bytes (e.g., serialized data) as 16 hexadecimal digits, for keys of the cache
+// [[Rcpp::export]]
+std::string data_hash(Rcpp::RawVector x){
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)cache_checksum(x.begin(), x.size()));
+  return std::string(hex);
+}
+
+//function that mixes the bytes of x into the FNV-1a hash h
+inline void hash_bytes(uint64_t &h, const void *x, size_t n){
+  const unsigned char *c = (const unsigned char*)x;
+  for(size_t i=0; i<n; i++){
+    h ^= c[i];
+    h *= 1099511628211ULL;
+  }
+}
+
+//function that returns a hash (16 hexadecimal digits) of the rows of each group (group, indexing starting at 1, of n_groups) of the
+//columns of a data frame (integer, double, factor, or character), for the cache of make_dat to find the groups whose data changed. 
+//Numbers are hashed as doubles and factors as their labels, so the hash doesn't depend on how the columns were read, and the hashes
+//of the rows are summed, so it doesn't depend on the order of the rows.
+// [[Rcpp::export]]
+Rcpp::CharacterVector group_hash(Rcpp::List dat, Rcpp::IntegerVector group, int n_groups){
+  R_xlen_t n_rows = group.size();
+  std::vector<uint64_t> row(n_rows, 14695981039346656037ULL), h(n_groups, 0);
+  Rcpp::CharacterVector names = dat.names();
+  for(int j=0; j<dat.size(); j++){
+    SEXP col = dat[j];
+    if(Rf_xlength(col)!=n_rows) Rcpp::stop("columns must have a row for each element of group");
+    if(Rf_isFactor(col) || TYPEOF(col)==STRSXP){
+      SEXP lev = Rf_isFactor(col) ? Rf_getAttrib(col, R_LevelsSymbol) : R_NilValue;
+      for(R_xlen_t i=0; i<n_rows; i++){
+        SEXP s = lev==R_NilValue ? STRING_ELT(col,i) : (INTEGER(col)[i]==NA_INTEGER ? NA_STRING : STRING_ELT(lev,INTEGER(col)[i]-1));
+        if(s==NA_STRING){
+          unsigned char na = 255;
+          hash_bytes(row[i], &na, 1);
+        }else{
+          hash_bytes(row[i], CHAR(s), std::strlen(CHAR(s))+1);
+        }
+      }
+    }else if(TYPEOF(col)==INTSXP || TYPEOF(col)==LGLSXP || TYPEOF(col)==REALSXP){
+      for(R_xlen_t i=0; i<n_rows; i++){
+        double x = TYPEOF(col)==REALSXP ? REAL(col)[i] : (INTEGER(col)[i]==NA_INTEGER ? NA_REAL : (double)INTEGER(col)[i]);
+        if(ISNAN(x)) x = NA_REAL; //one NA for NA and NaN
+        hash_bytes(row[i], &x, 8);
+      }
+    }else{
+      Rcpp::stop("column %s has an unsupported type", Rcpp::as<std::string>(names[j]));
+    }
+  }
+  for(R_xlen_t i=0; i<n_rows; i++){
+    if(group[i]==NA_INTEGER || group[i]<1 || group[i]>n_groups) Rcpp::stop("group must be between 1 and n_groups");
+    uint64_t x = row[i]; //finalizer of splitmix64, so the sum of the hashes of the rows doesn't cancel structured changes
+    x = (x^(x>>30))*0xBF58476D1CE4E5B9ULL;
+    x = (x^(x>>27))*0x94D049BB133111EBULL;
+    h[group[i]-1] += x^(x>>31);
+  }
+  Rcpp::CharacterVector out(n_groups);
+  char hex[17];
+  for(int g=0; g<n_groups; g++){
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h[g]);
+    out[g] = hex;
+  }
+  return out;
+}
+
+//buffer that the cache is written to
+struct cache_writer {
+  std::vector<unsigned char> buf;
+
+  void bytes(const void *x, size_t n){
+    const unsigned char *c = (const unsigned char*)x;
+    buf.insert(buf.end(), c, c+n);
+  }
+  void u32(uint32_t x){bytes(&x,4);}
+  void str(const std::string &s){u32(s.size()); bytes(s.data(),s.size());}
+  void pad(){buf.resize((buf.size()+7)/8*8,0);}
+};
+
+//reader of a cache in memory (or memory mapped), which returns false if it would read past the end
+struct cache_reader {
+  const unsigned char *x;
+  size_t n, pos;
+
+  bool bytes(void *out, size_t m){
+    if(pos+m>n) return false;
+    std::memcpy(out, x+pos, m);
+    pos += m;
+    return true;
+  }
+  bool u32(uint32_t &out){return bytes(&out,4);}
+  bool str(std::string &out){
+    uint32_t m;
+    if(!u32(m) || pos+m>n) return false;
+    out.assign((const char*)x+pos, m);
+    pos += m;
+    return true;
+  }
+  void pad(){pos = (pos+7)/8*8;}
+};
+
+//writes integer codes (NA as NA_INTEGER) in 1 byte if possible, otherwise in 4 bytes
+void write_codes(cache_writer &w, const std::vector<std::string> &levels, const int *codes, size_t n, uint32_t kind){
+  bool small = true;
+  for(size_t i=0; i<n && small; i++) small = codes[i]==NA_INTEGER || (codes[i]>=0 && codes[i]<255);
+  w.u32(kind);
+  w.u32(small ? 1 : 4);
+  w.u32(levels.size());
+  for(size_t l=0; l<levels.size(); l++) w.str(levels[l]);
+  w.pad();
+  if(small){
+    for(size_t i=0; i<n; i++){
+      unsigned char c = codes[i]==NA_INTEGER ? 255 : codes[i];
+      w.bytes(&c,1);
+    }
+  }else{
+    w.bytes(codes,4*n);
+  }
+  w.pad();
+}
+
+//function that writes the columns of a data frame (integer, double, factor, or character) to a cache at path, with a key that
+//identifies the data and arguments it was made from
+// [[Rcpp::export]]
+void write_ch_cache(Rcpp::List dat, std::string path, std::string key){
+  Rcpp::CharacterVector names = dat.names();
+  uint64_t n_rows = dat.size() ? Rf_length(dat[0]) : 0;
+  cache_writer w;
+  w.buf.resize(ch_cache_header,0);
+  w.str(key);
+  w.pad();
+  for(int j=0; j<dat.size(); j++){
+    SEXP col = dat[j];
+    if((uint64_t)Rf_length(col)!=n_rows) Rcpp::stop("columns must have the same length");
+    w.str(Rcpp::as<std::string>(names[j]));
+    w.pad();
+    if(Rf_isFactor(col)){
+      Rcpp::CharacterVector lev = Rf_getAttrib(col, R_LevelsSymbol);
+      std::vector<std::string> levels(lev.begin(), lev.end());
+      write_codes(w, levels, INTEGER(col), n_rows, factor_col);
+    }else if(TYPEOF(col)==STRSXP){ //code as a factor, with levels in order of appearance
+      std::unordered_map<std::string,int> code;
+      std::vector<std::string> levels;
+      std::vector<int> codes(n_rows);
+      for(uint64_t i=0; i<n_rows; i++){
+        SEXP s = STRING_ELT(col,i);
+        if(s==NA_STRING){codes[i] = NA_INTEGER; continue;}
+        std::pair<std::unordered_map<std::string,int>::iterator,bool> it = code.emplace(CHAR(s), levels.size()+1);
+        if(it.second) levels.push_back(CHAR(s));
+        codes[i] = it.first->second;
+      }
+      write_codes(w, levels, codes.data(), n_rows, character_col);
+    }else if(TYPEOF(col)==INTSXP || TYPEOF(col)==LGLSXP){
+      write_codes(w, std::vector<std::string>(), INTEGER(col), n_rows, integer_col);
+    }else if(TYPEOF(col)==REALSXP){
+      w.u32(double_col);
+      w.u32(8);
+      w.u32(0);
+      w.pad();
+      w.bytes(REAL(col), 8*n_rows);
+      w.pad();
+    }else{
+      Rcpp::stop("column %s has an unsupported type", Rcpp::as<std::string>(names[j]));
+    }
+  }
+  //header
+  uint32_t n_cols = dat.size();
+  uint64_t check = cache_checksum(w.buf.data()+ch_cache_header, w.buf.size()-ch_cache_header);
+  std::memcpy(&w.buf[0], ch_cache_magic, 8);
+  std::memcpy(&w.buf[8], &ch_cache_version, 4);
+  std::memcpy(&w.buf[12], &n_cols, 4);
+  std::memcpy(&w.buf[16], &n_rows, 8);
+  std::memcpy(&w.buf[24], &check, 8);
+  std::ofstream out(path.c_str(), std::ios::binary);
+  out.write((const char*)w.buf.data(), w.buf.size());
+  if(!out) Rcpp::stop("could not write %s", path);
+}
+
+//function that parses a cache into a data frame, or returns NULL if it is not a valid cache with this key
+Rcpp::RObject parse_ch_cache(const unsigned char *x, size_t n, const std::string &key){
+  cache_reader r = {x, n, 0};
+  char magic[8];
+  uint32_t version, n_cols;
+  uint64_t n_rows, check;
+  if(!r.bytes(magic,8) || std::memcmp(magic,ch_cache_magic,8)!=0) return R_NilValue;
+  if(!r.u32(version) || version!=ch_cache_version) return R_NilValue;
+  if(!r.u32(n_cols) || !r.bytes(&n_rows,8) || !r.bytes(&check,8)) return R_NilValue;
+  if(cache_checksum(x+ch_cache_header, n-ch_cache_header)!=check){
+    Rcpp::warning("capture history cache is corrupt (checksum does not match)");
+    return R_NilValue;
+  }
+  std::string cache_key;
+  if(!r.str(cache_key) || cache_key!=key) return R_NilValue;
+  r.pad();
+  Rcpp::List dat(n_cols);
+  Rcpp::CharacterVector names(n_cols);
+  for(uint32_t j=0; j<n_cols; j++){
+    std::string name;
+    uint32_t kind, width, n_levels;
+    if(!r.str(name)) return R_NilValue;
+    r.pad();
+    if(!r.u32(kind) || !r.u32(width) || !r.u32(n_levels)) return R_NilValue;
+    names[j] = name;
+    std::vector<std::string> levels(n_levels);
+    for(uint32_t l=0; l<n_levels; l++) if(!r.str(levels[l])) return R_NilValue;
+    r.pad();
+    if(r.pos+width*n_rows>n) return R_NilValue;
+    const unsigned char *v = x+r.pos;
+    if(kind==double_col){
+      Rcpp::NumericVector col(n_rows);
+      std::memcpy(col.begin(), v, 8*n_rows);
+      dat[j] = col;
+    }else{
+      Rcpp::IntegerVector codes(n_rows);
+      if(width==1){
+        for(uint64_t i=0; i<n_rows; i++) codes[i] = v[i]==255 ? NA_INTEGER : v[i];
+      }else{
+        std::memcpy(codes.begin(), v, 4*n_rows);
+      }
+      if(kind==factor_col){
+        codes.attr("levels") = Rcpp::wrap(levels);
+        codes.attr("class") = "factor";
+        dat[j] = codes;
+      }else if(kind==character_col){
+        Rcpp::CharacterVector col(n_rows);
+        for(uint64_t i=0; i<n_rows; i++) col[i] = codes[i]==NA_INTEGER ? NA_STRING : Rcpp::String(levels[codes[i]-1]);
+        dat[j] = col;
+      }else{
+        dat[j] = codes;
+      }
+    }
+    r.pos += width*n_rows;
+    r.pad();
+  }
+  dat.attr("names") = names;
+  dat.attr("row.names") = Rcpp::IntegerVector::create(NA_INTEGER, -(int)n_rows);
+  dat.attr("class") = "data.frame";
+  return dat;
+}
+
+//function that reads a cache written by write_ch_cache, memory mapping the file where possible. Returns the data frame, or NULL
+//if the file does not exist, was made with another key or version, or is corrupt.
+// [[Rcpp::export]]
+Rcpp::RObject read_ch_cache(std::string path, std::string key){
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd<0) return R_NilValue;
+  struct stat st;
+  if(fstat(fd,&st)!=0 || (size_t)st.st_size<ch_cache_header){close(fd); return R_NilValue;}
+  size_t n = st.st_size;
+  void *x = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(x==MAP_FAILED) return R_NilValue;
+  Rcpp::RObject dat;
+  try{
+    dat = parse_ch_cache((const unsigned char*)x, n, key);
+  }catch(...){
+    munmap(x,n);
+    throw;
+  }
+  munmap(x,n);
+  return dat;
+#else
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if(!in) return R_NilValue;
+  std::vector<unsigned char> x((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if(x.size()<ch_cache_header) return R_NilValue;
+  return parse_ch_cache(x.data(), x.size(), key);
+#endif
+}
@@ -0,0 +1,87 @@
+#ifndef CTR_RNG_HPP
+#define CTR_RNG_HPP
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+// Counter-based random numbers and binomial draws shared by the SIMULATE block of wen_mscjs_re_4.cpp and ft_engine.cpp, so the
+// simulated detections of a cohort only depend on the key and counter of each draw.
+
+//counter-based random numbers (Philox4x32-10, Salmon et al. 2011). The stream of each binomial draw is keyed by the seed and
+//counted by (replicate, cohort, draw within the cohort), so draws don't depend on the order cohorts or replicates are simulated
+//in (e.g., by thread), and any cohort of any replicate can be simulated on its own.
+struct ctr_rng {
+  uint32_t key[2], ctr[4], out[4];
+  int used;
+  ctr_rng(uint64_t seed, uint32_t rep, uint32_t cohort, uint32_t slot): used(4) {
+    key[0] = (uint32_t)seed;
+    key[1] = (uint32_t)(seed>>32);
+    ctr[0] = rep;
+    ctr[1] = cohort;
+    ctr[2] = slot;
+    ctr[3] = 0;
+  }
+  void block(){
+    uint32_t c[4] = {ctr[0], ctr[1], ctr[2], ctr[3]}, k[2] = {key[0], key[1]};
+    for(int r=0; r<10; r++){
+      uint64_t p0 = (uint64_t)0xD2511F53*c[0], p1 = (uint64_t)0xCD9E8D57*c[2];
+      uint32_t n[4] = {(uint32_t)(p1>>32)^c[1]^k[0], (uint32_t)p1, (uint32_t)(p0>>32)^c[3]^k[1], (uint32_t)p0};
+      std::copy(n, n+4, c);
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    }
+    std::copy(c, c+4, out);
+    ctr[3]++;
+    used = 0;
+  }
+  uint32_t next(){
+    if(used==4) block();
+    return out[used++];
+  }
+  //uniform on (0,1) with 53 random bits
+  double unif(){
+    uint64_t a = next()>>5, b = next()>>6;
+    return (a*67108864.0+b+0.5)/9007199254740992.0;
+  }
+};
+
+//Stirling approximation error log(k!) - (k+0.5)log(k+1) + (k+1) - log(sqrt(2 pi)), tabulated for small k
+inline double stirling_tail(double k){
+  static const double tail[10] = {0.0810614667953272, 0.0413406959554092, 0.0276779256849983, 0.02079067210376509, 0.0166446911898211,
+                                  0.0138761288230707, 0.0118967099458917, 0.0104112652619720, 0.00925546218271273, 0.00833056343336287};
+  if(k<=9) return tail[(int)k];
+  double kp1sq = (k+1)*(k+1);
+  return (1.0/12-(1.0/360-1.0/1260/kp1sq)/kp1sq)/(k+1);
+}
+
+//function that draws a binomial(n, prob) count, by inversion (sums of geometric waiting times) if n*min(prob,1-prob) < 10, or else by
+//transformed rejection with squeeze (BTRS, Hormann 1993), which takes about the same time for any n (e.g., large n_released)
+inline long ctr_rbinom(long n, double prob, ctr_rng &rng){
+  if(n<=0 || !(prob>0)) return 0;
+  if(prob>=1) return n;
+  if(prob>0.5) return n-ctr_rbinom(n, 1-prob, rng);
+  if(n*prob<10){
+    double log_q = std::log1p(-prob);
+    long k = 0, t = 0;
+    while(true){
+      t += (long)std::ceil(std::log(rng.unif())/log_q);
+      if(t>n) return k;
+      k++;
+    }
+  }
+  double q = 1-prob, spq = std::sqrt(n*prob*q);
+  double b = 1.15+2.53*spq, a = -0.0873+0.0248*b+0.01*prob, c = n*prob+0.5, vr = 0.92-4.2/b;
+  double alpha = (2.83+5.1/b)*spq, r = prob/q, m = std::floor((n+1)*prob);
+  while(true){
+    double u = rng.unif()-0.5, v = rng.unif(), us = 0.5-std::abs(u);
+    double k = std::floor((2*a/us+b)*u+c);
+    if(k<0 || k>n) continue;
+    if(us>=0.07 && v<=vr) return (long)k;
+    v = std::log(v*alpha/(a/(us*us)+b));
+    double bound = (m+0.5)*std::log((m+1)/(r*(n-m+1)))+(n+1)*std::log((n-m+1)/(n-k+1))+(k+0.5)*std::log(r*(n-k+1)/(k+1))+
+      stirling_tail(m)+stirling_tail(n-m)-stirling_tail(k)-stirling_tail(n-k);
+    if(v<=bound) return (long)k;
+  }
+}
+
+#endif
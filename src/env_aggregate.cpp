@@ -0,0 +1,97 @@
+#include <Rcpp.h>
+#include <map>
+#include <vector>
+#include <cmath>
+
+// Seasonal aggregation of daily (or monthly) environmental series for Env data funcs.R, which computes the mean (or coefficient of
+// variation) of every seasonal window of every series in one pass over the data, rather than a subset and aggregate for each window.
+// Compile with Rcpp::sourceCpp.
+
+//running mean and sum of squared deviations (Welford), so the CV doesn't lose precision for large flows
+struct window_acc {
+  int n;
+  double mean, m2;
+  window_acc(): n(0), mean(0), m2(0) {}
+  void add(double y){
+    n++;
+    double d = y-mean;
+    mean += d/n;
+    m2 += d*(y-mean);
+  }
+};
+
+//function that returns the migration year of an observation in month of year for a window from first_month to last_month (which
+//wraps into the next year if first_month>last_month, e.g., October to February), or NA_INTEGER if the month isn't in the window
+inline int window_year(int year, int month, int first_month, int last_month, int year_shift){
+  if(first_month<=last_month){
+    if(month<first_month || month>last_month) return NA_INTEGER;
+    return year+year_shift;
+  }
+  if(month>=first_month) return year+1+year_shift; //months before the new year count towards the next year's window
+  if(month<=last_month) return year+year_shift;
+  return NA_INTEGER;
+}
+
+//function that returns a list with the migration years (mig_year) and a column of the mean or CV (stat "cv", sd/mean as in R) of each
+//window, where observations of y (NA are ignored) are in long form with the series (codes starting at 1), year, and month of each.
+//Each window is a list with the codes of the series it pools (series), first_month, last_month, and year_shift (added to the
+//migration year, e.g., 1 for the summer before migration), and optionally stat. Migration years without data are NA.
+// [[Rcpp::export]]
+Rcpp::List seasonal_aggregate(Rcpp::IntegerVector series, Rcpp::IntegerVector year, Rcpp::IntegerVector month, Rcpp::NumericVector y,
+                              Rcpp::List windows){
+  int n_win = windows.size(), n_series = 0;
+  for(int i=0; i<series.size(); i++) if(series[i]!=NA_INTEGER && series[i]>n_series) n_series = series[i];
+  std::vector<int> first(n_win), last(n_win), shift(n_win);
+  std::vector<bool> cv(n_win);
+  std::vector<std::vector<int> > series_windows(n_series+1); //windows of each series
+  for(int w=0; w<n_win; w++){
+    Rcpp::List win = windows[w];
+    first[w] = Rcpp::as<int>(win["first_month"]);
+    last[w] = Rcpp::as<int>(win["last_month"]);
+    shift[w] = win.containsElementNamed("year_shift") ? Rcpp::as<int>(win["year_shift"]) : 0;
+    cv[w] = win.containsElementNamed("stat") && Rcpp::as<std::string>(win["stat"])=="cv";
+    Rcpp::IntegerVector s = win["series"];
+    for(int j=0; j<s.size(); j++) if(s[j]>=1 && s[j]<=n_series) series_windows[s[j]].push_back(w);
+  }
+
+  //one pass over the observations
+  std::vector<std::map<int,window_acc> > acc(n_win);
+  std::map<int,bool> years;
+  for(int i=0; i<y.size(); i++){
+    if(series[i]==NA_INTEGER || year[i]==NA_INTEGER || month[i]==NA_INTEGER || ISNAN(y[i])) continue;
+    const std::vector<int> &sw = series_windows[series[i]];
+    for(size_t k=0; k<sw.size(); k++){
+      int w = sw[k];
+      int mig_year = window_year(year[i], month[i], first[w], last[w], shift[w]);
+      if(mig_year==NA_INTEGER) continue;
+      acc[w][mig_year].add(y[i]);
+      years[mig_year] = true;
+    }
+  }
+
+  //table of migration years x windows
+  Rcpp::IntegerVector mig_year(years.size());
+  std::map<int,int> row;
+  int r = 0;
+  for(std::map<int,bool>::const_iterator it=years.begin(); it!=years.end(); ++it, r++){
+    mig_year[r] = it->first;
+    row[it->first] = r;
+  }
+  Rcpp::List out(n_win+1);
+  out[0] = mig_year;
+  for(int w=0; w<n_win; w++){
+    Rcpp::NumericVector col(years.size(), NA_REAL);
+    for(std::map<int,window_acc>::const_iterator it=acc[w].begin(); it!=acc[w].end(); ++it){
+      const window_acc &a = it->second;
+      if(cv[w]) col[row[it->first]] = a.n>1 ? std::sqrt(a.m2/(a.n-1))/a.mean : NA_REAL;
+      else col[row[it->first]] = a.mean;
+    }
+    out[w+1] = col;
+  }
+  Rcpp::CharacterVector names(n_win+1);
+  names[0] = "mig_year";
+  Rcpp::CharacterVector win_names = windows.names();
+  for(int w=0; w<n_win; w++) names[w+1] = win_names[w];
+  out.attr("names") = names;
+  return out;
+}
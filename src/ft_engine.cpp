@@ -0,0 +1,415 @@
+#include <Rcpp.h>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "ctr_rng.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+// [[Rcpp::plugins(openmp)]]
+
+// Posterior predictive Freeman-Tukey test for mscjs_wen_helper_funcs.R (Freem_Tuk_P), which evaluates the expected and simulated
+// detections of each release cohort for each posterior draw (as the SIMULATE block of wen_mscjs_re_4.cpp), sums
+// them to the summary cells (LH x stream x seaward year x site/state), and calculates the Freeman-Tukey statistics, with draws spread
+// across threads. Also calculates the scaled quantile residuals for make_stan_res from any number of simulations at constant memory, or
+// exactly from the distribution of the detections without simulation.
+// Compile with Rcpp::sourceCpp.
+
+//simulation PIMs and releases (the data of the SIMULATE block), copied from R so draws can be evaluated in parallel
+struct sim_design {
+  int n_cohorts, n_OCC, nDS_OCC, nUS_OCC, n_groups, n_states;
+  std::vector<int> phi_pim, p_pim, psi_pim, n_released, f_rel;
+  int phi_idx(int n, int t) const {return phi_pim[n+t*n_cohorts];}
+  int p_idx(int n, int t) const {return p_pim[n+t*n_cohorts];}
+  //column of the detections of state k at occasion t (from the ocean occasion for states after 1), with a column per occasion of
+  //state 1 followed by blocks of n_OCC-nDS_OCC columns for states 2, ..., n_states
+  int col(int k, int t) const {return k==1 ? t : n_OCC+(k-2)*(n_OCC-nDS_OCC)+t-nDS_OCC;}
+  int n_col() const {return n_OCC+(n_states-1)*(n_OCC-nDS_OCC);}
+};
+
+//function that returns phi, p, or psi at index i (0 if it is NA or out of range, e.g., the p fixed at 0 after the last row)
+inline double par_at(const std::vector<double> &par, int i){
+  return (i<0 || i>=(int)par.size()) ? 0 : par[i];
+}
+
+//function that calculates the expected detections (det) of each cohort (rows) for states 1, ..., n_states (columns in blocks of n_OCC
+//for state 1 and n_OCC-nDS_OCC for the other states, see sim_design::col), from phi, p (with the fixed 0 appended), and psi (groups x
+//states, column major)
+void expected_detections(const sim_design &d, const std::vector<double> &phi, const std::vector<double> &p, const std::vector<double> &psi,
+                         std::vector<double> &det){
+  int nc = d.n_cohorts, nDS = d.nDS_OCC, nUS = d.nUS_OCC, K = d.n_states;
+  std::vector<double> pS(K+1); //state probs: dead (unused), 1, ..., K
+  std::fill(det.begin(), det.end(), 0.0);
+  for(int n=0; n<nc; n++){
+    double N = d.n_released[n];
+    int g = d.psi_pim[n];
+    pS[1] = 1;
+    for(int t=d.f_rel[n]; t<nDS; t++){
+      pS[1] *= par_at(phi, d.phi_idx(n,t));
+      det[n+t*nc] = par_at(p, d.p_idx(n,t))*pS[1]*N;
+    }
+    double alive = pS[1]*par_at(phi, d.phi_idx(n,nDS));
+    for(int k=1; k<=K; k++) pS[k] = alive*par_at(psi, g+(k-1)*d.n_groups);
+    for(int t=nDS+1; t<d.n_OCC; t++){
+      int o = t-1;
+      for(int k=1; k<=K; k++){
+        det[n+d.col(k,o)*nc] = pS[k]*par_at(p, d.p_idx(n,o+(k-1)*nUS))*N;
+        pS[k] *= par_at(phi, d.phi_idx(n,t+(k-1)*nUS));
+      }
+    }
+    for(int k=1; k<=K; k++) det[n+d.col(k,d.n_OCC-1)*nc] = pS[k]*N;
+  }
+}
+
+//function that calculates the expected (det, see expected_detections) and simulated (sim) detections of each cohort for replicate rep
+void draw_detections(const sim_design &d, const std::vector<double> &phi, const std::vector<double> &p, const std::vector<double> &psi,
+                     uint64_t seed, uint32_t rep, std::vector<double> &det, std::vector<double> &sim){
+  int nc = d.n_cohorts, nDS = d.nDS_OCC, nUS = d.nUS_OCC, K = d.n_states;
+  expected_detections(d, phi, p, psi, det);
+  std::fill(sim.begin(), sim.end(), 0.0);
+  std::vector<long> s(K+1); //number alive in each state: dead (unused), 1, ..., K
+  for(int n=0; n<nc; n++){
+    uint32_t slot = 0; //each draw of the cohort has its own stream
+    auto draw = [&](long size, double prob){
+      ctr_rng rng(seed, rep, n, slot++);
+      return ctr_rbinom(size, prob, rng);
+    };
+    int g = d.psi_pim[n];
+    //simulated detections
+    s[1] = d.n_released[n];
+    for(int t=d.f_rel[n]; t<nDS; t++){
+      s[1] = draw(s[1], par_at(phi, d.phi_idx(n,t)));
+      sim[n+t*nc] = draw(s[1], par_at(p, d.p_idx(n,t)));
+    }
+    //maturation age, multinomial through sequential binomials of each state given not returning in the earlier states
+    long ocean = draw(s[1], par_at(phi, d.phi_idx(n,nDS)));
+    for(int k=1; k<K; k++){
+      double rest = 0; //prob of state k or later
+      for(int j=k; j<=K; j++) rest += par_at(psi, g+(j-1)*d.n_groups);
+      s[k] = draw(ocean, rest>0 ? par_at(psi, g+(k-1)*d.n_groups)/rest : 0);
+      ocean -= s[k];
+    }
+    s[K] = ocean;
+    for(int t=nDS+1; t<d.n_OCC; t++){
+      int o = t-1;
+      for(int k=1; k<=K; k++){
+        sim[n+d.col(k,o)*nc] = draw(s[k], par_at(p, d.p_idx(n,o+(k-1)*nUS)));
+        s[k] = draw(s[k], par_at(phi, d.phi_idx(n,t+(k-1)*nUS)));
+      }
+    }
+    for(int k=1; k<=K; k++) sim[n+d.col(k,d.n_OCC-1)*nc] = s[k];
+  }
+}
+
+//function that backtransforms the multinomial logit linear predictors of maturation age (as psi_mlogit in wen_mscjs_re_4.cpp)
+void psi_mlogit(const double *eta, int n_groups, int n_states, std::vector<double> &psi){
+  int ref = n_states>1 ? 1 : 0;
+  for(int g=0; g<n_groups; g++){
+    double denom = 1;
+    for(int b=0; b<n_states-1; b++) denom += std::exp(eta[g+b*n_groups]);
+    for(int k=0, b=0; k<n_states; k++){
+      if(k==ref){
+        psi[g+k*n_groups] = 1/denom;
+      }else{
+        psi[g+k*n_groups] = std::exp(eta[g+b*n_groups])/denom;
+        b++;
+      }
+    }
+  }
+}
+
+//probability mass function of a count on lo, lo+1, ..., lo+w.size()-1 (with negligible tails dropped)
+struct count_pmf {
+  long lo;
+  std::vector<double> w;
+  count_pmf(): lo(0), w(1, 1.0) {}
+};
+
+//function that returns the pmf of a binomial(N, prob) count, dropping tails below tol relative to the mode
+count_pmf binom_pmf(long N, double prob, double tol = 1e-16){
+  count_pmf out;
+  if(N<=0 || !(prob>0)) return out;
+  if(prob>=1){
+    out.lo = N;
+    return out;
+  }
+  long mode = std::min(N, (long)std::floor((N+1)*prob));
+  double odds = prob/(1-prob);
+  std::vector<double> up(1, 1.0), down;
+  for(long k=mode; k<N; k++){ //k+1 from k
+    double v = up.back()*(N-k)/(k+1)*odds;
+    if(v<tol) break;
+    up.push_back(v);
+  }
+  double v = 1;
+  for(long k=mode; k>0; k--){ //k-1 from k
+    v *= k/((N-k+1)*odds);
+    if(v<tol) break;
+    down.push_back(v);
+  }
+  out.lo = mode-(long)down.size();
+  out.w.assign(down.rbegin(), down.rend());
+  out.w.insert(out.w.end(), up.begin(), up.end());
+  double tot = 0;
+  for(size_t k=0; k<out.w.size(); k++) tot += out.w[k];
+  for(size_t k=0; k<out.w.size(); k++) out.w[k] /= tot;
+  return out;
+}
+
+//function that returns the pmf of the sum of two independent counts (convolution), dropping tails below tol relative to the largest mass
+count_pmf convolve(const count_pmf &a, const count_pmf &b, double tol = 1e-16){
+  count_pmf out;
+  out.lo = a.lo+b.lo;
+  out.w.assign(a.w.size()+b.w.size()-1, 0.0);
+  for(size_t i=0; i<a.w.size(); i++){
+    for(size_t j=0; j<b.w.size(); j++) out.w[i+j] += a.w[i]*b.w[j];
+  }
+  double top = *std::max_element(out.w.begin(), out.w.end());
+  size_t first = 0, last = out.w.size();
+  while(first<last && out.w[first]<tol*top) first++;
+  while(last>first && out.w[last-1]<tol*top) last--;
+  out.lo += first;
+  out.w = std::vector<double>(out.w.begin()+first, out.w.begin()+last);
+  return out;
+}
+
+//function that copies the simulation data of the model into a sim_design and checks the dimensions of it and the summary cells
+sim_design make_design(int n_groups, int n_states, Rcpp::IntegerMatrix phi_pim_sim, Rcpp::IntegerMatrix p_pim_sim,
+                       Rcpp::IntegerVector psi_pim_sim, Rcpp::IntegerVector n_released, Rcpp::IntegerVector f_rel, int n_OCC,
+                       int nDS_OCC, Rcpp::IntegerMatrix cell, int n_cells){
+  if(n_states<1) Rcpp::stop("n_states must be at least 1");
+  sim_design d;
+  d.n_cohorts = n_released.size();
+  d.n_OCC = n_OCC;
+  d.nDS_OCC = nDS_OCC;
+  d.nUS_OCC = d.n_OCC-nDS_OCC-1;
+  d.n_groups = n_groups;
+  d.n_states = n_states;
+  d.phi_pim.assign(phi_pim_sim.begin(), phi_pim_sim.end());
+  d.p_pim.assign(p_pim_sim.begin(), p_pim_sim.end());
+  d.psi_pim.assign(psi_pim_sim.begin(), psi_pim_sim.end());
+  d.n_released.assign(n_released.begin(), n_released.end());
+  d.f_rel.assign(f_rel.begin(), f_rel.end());
+  if(cell.nrow()!=d.n_cohorts || cell.ncol()!=d.n_col()) Rcpp::stop("cell must have a row per cohort and a column per state and occasion");
+  if(phi_pim_sim.nrow()!=d.n_cohorts || phi_pim_sim.ncol()!=n_OCC+(n_states-1)*d.nUS_OCC || p_pim_sim.nrow()!=d.n_cohorts ||
+     p_pim_sim.ncol()!=n_OCC-1+(n_states-1)*d.nUS_OCC) Rcpp::stop("simulation PIMs must have a row per cohort and a column per state and occasion");
+  for(Rcpp::IntegerMatrix::iterator c=cell.begin(); c!=cell.end(); ++c){
+    if(*c!=NA_INTEGER && (*c<0 || *c>=n_cells)) Rcpp::stop("cell is out of range of obs");
+  }
+  return d;
+}
+
+//function that backtransforms the linear predictors of one parameter set into phi, p (with the fixed 0 appended), and psi
+void backtransform(const double *e_phi, const double *e_p, const double *e_psi, const sim_design &d, std::vector<double> &phi,
+                   std::vector<double> &p, std::vector<double> &psi){
+  for(size_t k=0; k<phi.size(); k++) phi[k] = 1/(1+std::exp(-e_phi[k]));
+  for(size_t k=0; k+1<p.size(); k++) p[k] = 1/(1+std::exp(-e_p[k]));
+  p.back() = 0;
+  psi_mlogit(e_psi, d.n_groups, d.n_states, psi);
+}
+
+//function that sums the detections of each cohort and state occasion (det) to the summary cells (tot)
+void sum_cells(const std::vector<int> &cells, const std::vector<double> &det, std::vector<double> &tot){
+  std::fill(tot.begin(), tot.end(), 0.0);
+  for(size_t j=0; j<cells.size(); j++) if(cells[j]!=NA_INTEGER) tot[cells[j]] += det[j];
+}
+
+//function that returns the Freeman-Tukey posterior predictive p-value (p), the statistics of the observed (FT_ref) and simulated (FT_sim)
+//detections for each posterior draw, and, if keep_sims, the simulated detections of each summary cell (post_pred, cells x draws).
+//eta_phi, eta_p, and eta_psi are the linear predictors of each draw (columns), phi_pim_sim, p_pim_sim, psi_pim_sim, n_released,
+//and f_rel are the simulation data of the model, and cell is the summary cell (row of obs, indexing starts at 0, or NA if not
+//summarized) of the detections of each cohort (rows) and state 1, 2, and 3 occasion (columns). Draw i is simulated as replicate i of
+//the counter-based random numbers from seed, so results don't depend on the number of threads.
+// [[Rcpp::export]]
+Rcpp::List ft_engine(Rcpp::NumericMatrix eta_phi, Rcpp::NumericMatrix eta_p, Rcpp::NumericMatrix eta_psi, int n_groups, int n_states,
+                     Rcpp::IntegerMatrix phi_pim_sim, Rcpp::IntegerMatrix p_pim_sim, Rcpp::IntegerVector psi_pim_sim,
+                     Rcpp::IntegerVector n_released, Rcpp::IntegerVector f_rel, int n_OCC, int nDS_OCC, Rcpp::IntegerMatrix cell,
+                     Rcpp::NumericVector obs, bool keep_sims = true, int n_threads = 1, double seed = 1){
+  int n_draws = eta_phi.ncol(), n_cells = obs.size();
+  if(eta_p.ncol()!=n_draws || eta_psi.ncol()!=n_draws) Rcpp::stop("eta_phi, eta_p, and eta_psi must have a column per draw");
+  if(eta_psi.nrow()!=n_groups*(n_states-1)) Rcpp::stop("eta_psi must have n_groups x (n_states-1) rows");
+  sim_design d = make_design(n_groups, n_states, phi_pim_sim, p_pim_sim, psi_pim_sim, n_released, f_rel, n_OCC, nDS_OCC, cell, n_cells);
+  int n_col = cell.ncol();
+  std::vector<int> cells(cell.begin(), cell.end());
+  std::vector<double> sqrt_obs(n_cells);
+  for(int c=0; c<n_cells; c++) sqrt_obs[c] = std::sqrt(obs[c]);
+
+  Rcpp::NumericVector FT_ref(n_draws), FT_sim(n_draws);
+  Rcpp::NumericMatrix post_pred(keep_sims ? n_cells : 0, keep_sims ? n_draws : 0);
+  double *ft_ref = FT_ref.begin(), *ft_sim = FT_sim.begin(), *pp = post_pred.begin();
+  const double *e_phi = eta_phi.begin(), *e_p = eta_p.begin(), *e_psi = eta_psi.begin();
+  int n_phi = eta_phi.nrow(), n_p = eta_p.nrow(), n_psi = eta_psi.nrow();
+  uint64_t base_seed = (uint64_t)seed;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+  {
+  std::vector<double> phi(n_phi), p(n_p+1), psi(n_groups*n_states);
+  std::vector<double> det(d.n_cohorts*n_col), sim(d.n_cohorts*n_col), exp_cell(n_cells), sim_cell(n_cells);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+  for(int i=0; i<n_draws; i++){
+    backtransform(e_phi+(size_t)i*n_phi, e_p+(size_t)i*n_p, e_psi+(size_t)i*n_psi, d, phi, p, psi);
+    draw_detections(d, phi, p, psi, base_seed, i, det, sim);
+    sum_cells(cells, det, exp_cell);
+    sum_cells(cells, sim, sim_cell);
+    double ref = 0, fs = 0;
+    for(int c=0; c<n_cells; c++){
+      double se = std::sqrt(exp_cell[c]);
+      ref += (sqrt_obs[c]-se)*(sqrt_obs[c]-se);
+      fs += (std::sqrt(sim_cell[c])-se)*(std::sqrt(sim_cell[c])-se);
+    }
+    ft_ref[i] = ref;
+    ft_sim[i] = fs;
+    if(keep_sims) std::copy(sim_cell.begin(), sim_cell.end(), pp+(size_t)i*n_cells);
+  }
+  }
+
+  //Bayesian p-value (draws with NaN statistics are excluded)
+  int n_ok = 0, n_gt = 0;
+  for(int i=0; i<n_draws; i++){
+    if(std::isnan(ft_ref[i]) || std::isnan(ft_sim[i])) continue;
+    n_ok++;
+    n_gt += ft_sim[i]>ft_ref[i];
+  }
+  return Rcpp::List::create(Rcpp::Named("p") = n_ok ? double(n_gt)/n_ok : NA_REAL,
+                            Rcpp::Named("FT_ref") = FT_ref,
+                            Rcpp::Named("FT_sim") = FT_sim,
+                            Rcpp::Named("post_pred") = post_pred);
+}
+
+//function that returns the scaled (quantile) residuals of the observed detections of each summary cell (obs) against n_sims data sets
+//simulated from one parameter set (eta_phi, eta_p, and eta_psi, other arguments as ft_engine), as DHARMa with integerResponse (the
+//residual is uniform between the proportions of simulations below and at or below the observation), and the number of residuals
+//outside the simulations (outliers, below and above). Simulations are summarized by counts for each cell as they are generated, so
+//memory doesn't depend on n_sims.
+// [[Rcpp::export]]
+Rcpp::List res_engine(Rcpp::NumericVector eta_phi, Rcpp::NumericVector eta_p, Rcpp::NumericVector eta_psi, int n_groups, int n_states,
+                      Rcpp::IntegerMatrix phi_pim_sim, Rcpp::IntegerMatrix p_pim_sim, Rcpp::IntegerVector psi_pim_sim,
+                      Rcpp::IntegerVector n_released, Rcpp::IntegerVector f_rel, int n_OCC, int nDS_OCC, Rcpp::IntegerMatrix cell,
+                      Rcpp::NumericVector obs, int n_sims, int n_threads = 1, double seed = 1){
+  int n_cells = obs.size();
+  if(eta_psi.size()!=n_groups*(n_states-1)) Rcpp::stop("eta_psi must have n_groups x (n_states-1) elements");
+  if(n_sims<1) Rcpp::stop("n_sims must be at least 1");
+  sim_design d = make_design(n_groups, n_states, phi_pim_sim, p_pim_sim, psi_pim_sim, n_released, f_rel, n_OCC, nDS_OCC, cell, n_cells);
+  int n_col = cell.ncol();
+  std::vector<int> cells(cell.begin(), cell.end());
+  std::vector<double> ob(obs.begin(), obs.end());
+  std::vector<double> phi(eta_phi.size()), p(eta_p.size()+1), psi(n_groups*n_states);
+  backtransform(eta_phi.begin(), eta_p.begin(), eta_psi.begin(), d, phi, p, psi);
+  std::vector<long> n_below(n_cells, 0), n_equal(n_cells, 0);
+  uint64_t base_seed = (uint64_t)seed;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n_threads)
+#endif
+  {
+  std::vector<double> det(d.n_cohorts*n_col), sim(d.n_cohorts*n_col), sim_cell(n_cells);
+  std::vector<long> below(n_cells, 0), equal(n_cells, 0);
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+  for(int i=0; i<n_sims; i++){
+    draw_detections(d, phi, p, psi, base_seed, i, det, sim);
+    sum_cells(cells, sim, sim_cell);
+    for(int c=0; c<n_cells; c++){
+      below[c] += sim_cell[c]<ob[c];
+      equal[c] += sim_cell[c]==ob[c];
+    }
+  }
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+  for(int c=0; c<n_cells; c++){
+    n_below[c] += below[c];
+    n_equal[c] += equal[c];
+  }
+  }
+
+  //randomized quantiles for ties (from the stream after the simulations)
+  ctr_rng rng(base_seed, n_sims, 0, 0);
+  Rcpp::NumericVector res(n_cells);
+  int out_low = 0, out_high = 0;
+  for(int c=0; c<n_cells; c++){
+    double lo = double(n_below[c])/n_sims, hi = double(n_below[c]+n_equal[c])/n_sims;
+    res[c] = lo==hi ? lo : lo+(hi-lo)*rng.unif();
+    out_low += hi==0;
+    out_high += lo==1;
+  }
+  Rcpp::IntegerVector outliers = Rcpp::IntegerVector::create(Rcpp::Named("below") = out_low, Rcpp::Named("above") = out_high);
+  return Rcpp::List::create(Rcpp::Named("scaledResiduals") = res,
+                            Rcpp::Named("outliers") = outliers,
+                            Rcpp::Named("n_sims") = n_sims);
+}
+
+//function that returns the exact randomized quantile residuals (scaledResiduals) of the observed detections of each summary cell (obs)
+//at one parameter set (arguments as res_engine), without simulation. The detections of a cohort at an occasion are binomial with the
+//probability of the expected detections (as det of the SIMULATE block), so a cell is Poisson-binomial, with the pmf
+//from the convolution of the binomial pmfs of its cohorts. Also returns the expected (exp_det) and variance (var_det) of the detections
+//of each cell, the Freeman-Tukey statistic of the observed detections (FT_ref), and its expectation for detections from the model
+//(FT_exp, the sum of the exact expectations of each cell).
+// [[Rcpp::export]]
+Rcpp::List exact_res(Rcpp::NumericVector eta_phi, Rcpp::NumericVector eta_p, Rcpp::NumericVector eta_psi, int n_groups, int n_states,
+                     Rcpp::IntegerMatrix phi_pim_sim, Rcpp::IntegerMatrix p_pim_sim, Rcpp::IntegerVector psi_pim_sim,
+                     Rcpp::IntegerVector n_released, Rcpp::IntegerVector f_rel, int n_OCC, int nDS_OCC, Rcpp::IntegerMatrix cell,
+                     Rcpp::NumericVector obs, int n_threads = 1, double seed = 1){
+  int n_cells = obs.size();
+  if(eta_psi.size()!=n_groups*(n_states-1)) Rcpp::stop("eta_psi must have n_groups x (n_states-1) elements");
+  sim_design d = make_design(n_groups, n_states, phi_pim_sim, p_pim_sim, psi_pim_sim, n_released, f_rel, n_OCC, nDS_OCC, cell, n_cells);
+  int n_col = cell.ncol();
+  std::vector<int> cells(cell.begin(), cell.end());
+  std::vector<double> ob(obs.begin(), obs.end());
+  std::vector<double> phi(eta_phi.size()), p(eta_p.size()+1), psi(n_groups*n_states), det(d.n_cohorts*n_col);
+  backtransform(eta_phi.begin(), eta_p.begin(), eta_psi.begin(), d, phi, p, psi);
+  expected_detections(d, phi, p, psi, det);
+  //detections (index of det) summed in each cell
+  std::vector<std::vector<int> > members(n_cells);
+  for(size_t j=0; j<cells.size(); j++) if(cells[j]!=NA_INTEGER) members[cells[j]].push_back(j);
+  uint64_t base_seed = (uint64_t)seed;
+
+  Rcpp::NumericVector res(n_cells), exp_det(n_cells), var_det(n_cells), FT_cell(n_cells);
+  double *r = res.begin(), *e = exp_det.begin(), *v = var_det.begin(), *ft = FT_cell.begin();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+#endif
+  for(int c=0; c<n_cells; c++){
+    count_pmf pmf;
+    double mu = 0, var = 0;
+    for(size_t k=0; k<members[c].size(); k++){
+      int j = members[c][k];
+      long N = d.n_released[j%d.n_cohorts];
+      if(N<=0 || !(det[j]>0)) continue;
+      double prob = std::min(1.0, det[j]/N);
+      mu += det[j];
+      var += det[j]*(1-prob);
+      pmf = convolve(pmf, binom_pmf(N, prob));
+    }
+    //randomized quantile of the observation between P(Y < y) and P(Y <= y)
+    double y = std::round(ob[c]), below = 0, at = 0, ft_exp = 0, sqrt_mu = std::sqrt(mu);
+    for(size_t k=0; k<pmf.w.size(); k++){
+      double count = pmf.lo+(double)k;
+      if(count<y) below += pmf.w[k];
+      else if(count==y) at = pmf.w[k];
+      ft_exp += pmf.w[k]*(std::sqrt(count)-sqrt_mu)*(std::sqrt(count)-sqrt_mu);
+    }
+    ctr_rng rng(base_seed, 0, c, 0);
+    r[c] = std::min(1.0, below+at*rng.unif());
+    e[c] = mu;
+    v[c] = var;
+    ft[c] = ft_exp;
+  }
+
+  double FT_ref = 0, FT_exp = 0;
+  for(int c=0; c<n_cells; c++){
+    FT_ref += (std::sqrt(ob[c])-std::sqrt(e[c]))*(std::sqrt(ob[c])-std::sqrt(e[c]));
+    FT_exp += ft[c];
+  }
+  return Rcpp::List::create(Rcpp::Named("scaledResiduals") = res,
+                            Rcpp::Named("exp_det") = exp_det,
+                            Rcpp::Named("var_det") = var_det,
+                            Rcpp::Named("FT_ref") = FT_ref,
+                            Rcpp::Named("FT_exp") = FT_exp);
+}
@@ -0,0 +1,66 @@
+#include <Rcpp.h>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+// Builds the parameter index matrices (PIMs) for Wen_MSCJS_re_3.R (make_dat) from integer coded keys with hash tables, rather
+// than by matching pasted strings. Each capture history (CH) has a group (LH, stream, seaward migration year, and continuous
+// covariate bins), coded as one integer per column, and the index of a parameter is the row of the design data with the same
+// group, time, and (optionally) stratum. Compile with Rcpp::sourceCpp.
+
+//hash of the integer codes of a group
+struct group_hash {
+  size_t operator()(const std::vector<int> &k) const {
+    size_t h = k.size();
+    for(size_t i=0; i<k.size(); i++) h ^= std::hash<int>()(k[i]) + 0x9e3779b9 + (h<<6) + (h>>2);
+    return h;
+  }
+};
+
+//function that returns the row of the design data (indexing starts at 0, or -1 if there isn't one) with the group of each CH and
+//each of the times (and the stratum, unless stratum is NA), where the first matching row is used as in match(). Keys are column
+//major matrices of the integer codes of the group of each CH (ch_key, n_ch x n_col) or design data row (dd_key, n_dd x n_col).
+std::vector<int> match_pim(const int *ch_key, int n_ch, const int *dd_key, const int *dd_time, const int *dd_stratum, int n_dd, int n_col,
+                           const int *times, int n_times, int stratum){
+  //number the groups of the design data
+  std::unordered_map<std::vector<int>,int,group_hash> groups;
+  std::vector<int> dd_grp(n_dd), k(n_col);
+  for(int r=0; r<n_dd; r++){
+    for(int c=0; c<n_col; c++) k[c] = dd_key[r+c*n_dd];
+    dd_grp[r] = groups.emplace(k,(int)groups.size()).first->second;
+  }
+  //first row of each group, time, and stratum
+  bool use_stratum = stratum!=NA_INTEGER;
+  std::unordered_map<uint64_t,int> rows;
+  for(int r=0; r<n_dd; r++){
+    if(use_stratum && dd_stratum[r]!=stratum) continue;
+    rows.emplace(((uint64_t)dd_grp[r]<<32) | (uint32_t)dd_time[r], r);
+  }
+  //row of each CH and time
+  std::vector<int> out(n_ch*n_times,-1);
+  for(int i=0; i<n_ch; i++){
+    for(int c=0; c<n_col; c++) k[c] = ch_key[i+c*n_ch];
+    std::unordered_map<std::vector<int>,int,group_hash>::const_iterator g = groups.find(k);
+    if(g==groups.end()) continue;
+    for(int t=0; t<n_times; t++){
+      std::unordered_map<uint64_t,int>::const_iterator r = rows.find(((uint64_t)g->second<<32) | (uint32_t)times[t]);
+      if(r!=rows.end()) out[i+t*n_ch] = r->second;
+    }
+  }
+  return out;
+}
+
+//PIM (n_ch x n_times) of the design data rows (indexing starts at 0, as for TMB) of each CH and time (and stratum, unless NA),
+//or NA where there is no design data. Numeric, like match(...)-1, so it is identical to the PIMs made by pasting strings.
+// [[Rcpp::export]]
+Rcpp::NumericMatrix pim_match(Rcpp::IntegerMatrix ch_key, Rcpp::IntegerMatrix dd_key, Rcpp::IntegerVector dd_time,
+                              Rcpp::IntegerVector dd_stratum, Rcpp::IntegerVector times, int stratum){
+  if(ch_key.ncol()!=dd_key.ncol()) Rcpp::stop("ch_key and dd_key must have the same columns");
+  if(dd_time.size()!=dd_key.nrow() || dd_stratum.size()!=dd_key.nrow()) Rcpp::stop("dd_time and dd_stratum must have a value per row of dd_key");
+  int n_ch = ch_key.nrow();
+  std::vector<int> rows = match_pim(ch_key.begin(), n_ch, dd_key.begin(), dd_time.begin(), dd_stratum.begin(), dd_key.nrow(),
+                                    dd_key.ncol(), times.begin(), times.size(), stratum);
+  Rcpp::NumericMatrix out(n_ch, times.size());
+  for(size_t i=0; i<rows.size(); i++) out[i] = rows[i]<0 ? NA_REAL : rows[i];
+  return out;
+}
@@ -0,0 +1,263 @@
+#include <Rcpp.h>
+#include <unordered_map>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Single pass reader of PTAGIS detection files (interrogation summaries, observation, and recapture files) for data_proc.R,
+// which keeps only the first (juvenile) or last (adult) detection of each marked fish at each occasion, so memory is bounded by
+// the number of marked fish x occasions rather than the number of detections. Compile with Rcpp::sourceCpp.
+
+//function that splits a CSV line into fields (fields may be quoted, with "" for a quote within a quoted field)
+void split_csv(const std::string &line, std::vector<std::string> &fields){
+  fields.clear();
+  std::string f;
+  bool quoted = false;
+  for(size_t i=0; i<line.size(); i++){
+    char c = line[i];
+    if(quoted){
+      if(c=='"'){
+        if(i+1<line.size() && line[i+1]=='"'){f += '"'; i++;}
+        else quoted = false;
+      }else{
+        f += c;
+      }
+    }else if(c=='"'){
+      quoted = true;
+    }else if(c==','){
+      fields.push_back(f);
+      f.clear();
+    }else if(c!='\r'){
+      f += c;
+    }
+  }
+  fields.push_back(f);
+}
+
+//function that returns the column of a field in the header, or stops if it is missing
+int csv_column(const std::vector<std::string> &header, const std::string &name, const std::string &path){
+  for(size_t j=0; j<header.size(); j++) if(header[j]==name) return j;
+  Rcpp::stop("column '%s' not found in %s", name, path);
+  return -1;
+}
+
+//day of year
+int day_of_year(int y, int m, int d){
+  static const int cum[12] = {0,31,59,90,120,151,181,212,243,273,304,334};
+  bool leap = (y%4==0 && y%100!=0) || y%400==0;
+  return cum[m-1] + d + (leap && m>2 ? 1 : 0);
+}
+
+//function that parses a date time in month/day/year hour:minute:second (AM/PM) format (as lubridate::mdy_hms) into the year, day
+//of year, and second of the day. Returns false if it isn't a date.
+bool parse_mdy_hms(const std::string &s, int &year, int &doy, int &sec){
+  int v[6] = {0,0,0,0,0,0}, n = 0;
+  const char *p = s.c_str();
+  while(*p && n<6){
+    if(*p>='0' && *p<='9'){
+      char *end;
+      v[n++] = std::strtol(p, &end, 10);
+      p = end;
+    }else{
+      p++;
+    }
+  }
+  if(n<3 || v[0]<1 || v[0]>12 || v[1]<1 || v[1]>31) return false;
+  if(s.find("PM")!=std::string::npos && v[3]<12) v[3] += 12;
+  if(s.find("AM")!=std::string::npos && v[3]==12) v[3] = 0;
+  year = v[2];
+  doy = day_of_year(v[2], v[0], v[1]);
+  sec = v[3]*3600 + v[4]*60 + v[5];
+  return true;
+}
+
+//Append-only store of the detections of each fish (Data/ptagis_det_store.bin in data_proc.R), so new detection files can be added to
+//the detections of earlier files without reading those again.
+//  header: magic "MSCJSDET", version (uint32), number of occasions (uint32)
+//  records: tag (uint32 length followed by the characters), occasion (int32), detection (int64, year*1e8+day*1e5+second)
+//where an occasion of -1 records that the fish was processed. A later record of a fish and occasion replaces the earlier one (it is
+//an earlier juvenile or later adult detection), so updates only append the fish and occasions that changed.
+const char det_store_magic[8] = {'M','S','C','J','S','D','E','T'};
+const uint32_t det_store_version = 1;
+
+//buffer of records of the store
+struct det_store_writer {
+  std::vector<unsigned char> buf;
+
+  void bytes(const void *x, size_t n){
+    const unsigned char *c = (const unsigned char*)x;
+    buf.insert(buf.end(), c, c+n);
+  }
+  void record(const std::string &tag, int32_t occ, int64_t d){
+    uint32_t n = tag.size();
+    bytes(&n,4);
+    bytes(tag.data(),n);
+    bytes(&occ,4);
+    bytes(&d,8);
+  }
+};
+
+//function that reads the store at path into the detections (det, fish x occasion) and processed fish (known) of the fish in tags.
+//Records of fish that aren't in tags are skipped, as is a partial record at the end (e.g., from an interrupted write).
+void read_det_store(const std::string &path, const std::unordered_map<std::string,int> &fish, int n_occ, std::vector<int64_t> &det,
+                    std::vector<bool> &known){
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if(!in) Rcpp::stop("could not open the detection store %s", path);
+  char magic[8];
+  uint32_t version, n;
+  if(!in.read(magic,8) || std::memcmp(magic,det_store_magic,8)!=0 || !in.read((char*)&version,4) || version!=det_store_version)
+    Rcpp::stop("%s is not a detection store of this version", path);
+  if(!in.read((char*)&n,4) || (int)n!=n_occ) Rcpp::stop("the detection store %s was made with other occasions", path);
+  size_t n_fish = known.size();
+  std::string tag;
+  int32_t occ;
+  int64_t d;
+  while(in.read((char*)&n,4)){
+    tag.resize(n);
+    if(!in.read(&tag[0],n) || !in.read((char*)&occ,4) || !in.read((char*)&d,8)) break;
+    std::unordered_map<std::string,int>::const_iterator f = fish.find(tag);
+    if(f==fish.end() || occ>=n_occ) continue;
+    if(occ<0) known[f->second] = true;
+    else det[(size_t)occ*n_fish + f->second] = d;
+  }
+}
+
+//function that returns the first (juvenile occasions, first_det) or last detection year and day of year of each marked fish (tags) at
+//each occasion (names of site_occ), from detection files (sources). site_occ gives the occasion (index starting at 0) of each site
+//code (names). Each source is a list with the path of a CSV file and the names of its tag and site columns, and either a date column
+//(observation or recapture files, where each row is a detection) or first and last year and day columns (interrogation summaries).
+//A source can also have an occasion (index starting at 0) that all of its detections are assigned to regardless of site, or sites
+//to keep (other sites are ignored). For incremental updates with new detection files, the detections in the store at path store
+//(see det_store_magic) are read first if append, and the new detections are added to them. The attributes are the fish whose
+//detections changed ("changed") and that weren't in the store ("new", all fish if not append), with indexing starting at 1, and the
+//records to add to the store ("records", or the whole store if not append), which are written by the caller once the capture
+//histories of these fish are saved. A tag in more than one row of tags (e.g., in both tagging files) gets its detections in each row,
+//as with a join on the tag.
+// [[Rcpp::export]]
+Rcpp::List ingest_ptagis(Rcpp::CharacterVector tags, Rcpp::List sources, Rcpp::IntegerVector site_occ, Rcpp::CharacterVector occasions,
+                         Rcpp::LogicalVector first_det, std::string store = "", bool append = false){
+  int n_rows = tags.size(), n_occ = occasions.size();
+  std::unordered_map<std::string,int> fish; //index of each unique tag
+  std::vector<std::string> tag;             //unique tags
+  std::vector<int> row_fish(n_rows);        //unique tag of each row of tags
+  for(int i=0; i<n_rows; i++){
+    std::string t = Rcpp::as<std::string>(tags[i]);
+    std::pair<std::unordered_map<std::string,int>::iterator,bool> f = fish.emplace(t, (int)tag.size());
+    if(f.second) tag.push_back(t);
+    row_fish[i] = f.first->second;
+  }
+  int n_fish = tag.size();
+  std::unordered_map<std::string,int> occ_of_site;
+  Rcpp::CharacterVector site_names = site_occ.names();
+  for(int s=0; s<site_occ.size(); s++) occ_of_site[Rcpp::as<std::string>(site_names[s])] = site_occ[s];
+  //detection of each fish (rows) and occasion (columns), as year*1e8+day*1e5+second so the first or last is the smallest or largest
+  const int64_t none = -1;
+  std::vector<int64_t> det((size_t)n_fish*n_occ, none);
+  std::vector<bool> known(n_fish,false);
+  if(append) read_det_store(store, fish, n_occ, det, known);
+  std::vector<int64_t> det_prev(det);
+
+  std::vector<std::string> header, fields;
+  std::string line;
+  for(int k=0; k<sources.size(); k++){
+    Rcpp::List src = sources[k];
+    std::string path = Rcpp::as<std::string>(src["path"]);
+    std::ifstream in(path.c_str());
+    if(!in) Rcpp::stop("could not open %s", path);
+    if(!std::getline(in,line)) continue;
+    if(line.size()>=3 && line.compare(0,3,"\xEF\xBB\xBF")==0) line.erase(0,3); //byte order mark
+    split_csv(line, header);
+    int tag_col = csv_column(header, Rcpp::as<std::string>(src["tag"]), path);
+    int site_col = csv_column(header, Rcpp::as<std::string>(src["site"]), path);
+    bool dated = src.containsElementNamed("date");
+    int date_col=-1, fy_col=-1, fd_col=-1, ly_col=-1, ld_col=-1;
+    if(dated){
+      date_col = csv_column(header, Rcpp::as<std::string>(src["date"]), path);
+    }else{
+      fy_col = csv_column(header, Rcpp::as<std::string>(src["first_year"]), path);
+      fd_col = csv_column(header, Rcpp::as<std::string>(src["first_day"]), path);
+      ly_col = csv_column(header, Rcpp::as<std::string>(src["last_year"]), path);
+      ld_col = csv_column(header, Rcpp::as<std::string>(src["last_day"]), path);
+    }
+    int src_occ = src.containsElementNamed("occasion") ? Rcpp::as<int>(src["occasion"]) : -1;
+    std::unordered_map<std::string,bool> keep;
+    if(src.containsElementNamed("sites")){
+      Rcpp::CharacterVector s = src["sites"];
+      for(int j=0; j<s.size(); j++) keep[Rcpp::as<std::string>(s[j])] = true;
+    }
+
+    long row = 0;
+    while(std::getline(in,line)){
+      if((++row % 1000000)==0) Rcpp::checkUserInterrupt();
+      split_csv(line, fields);
+      if((int)fields.size()<(int)header.size()) continue;
+      std::unordered_map<std::string,int>::const_iterator f = fish.find(fields[tag_col]);
+      if(f==fish.end()) continue; //not a marked fish
+      const std::string &site = fields[site_col];
+      if(!keep.empty() && keep.find(site)==keep.end()) continue;
+      int o = src_occ;
+      if(o<0){
+        std::unordered_map<std::string,int>::const_iterator s = occ_of_site.find(site);
+        if(s==occ_of_site.end()) continue;
+        o = s->second;
+      }
+      int64_t d;
+      if(dated){
+        int year, doy, sec;
+        if(!parse_mdy_hms(fields[date_col], year, doy, sec)) continue;
+        d = (int64_t)year*100000000 + (int64_t)doy*100000 + sec;
+      }else{
+        const std::string &y = fields[first_det[o] ? fy_col : ly_col], &day = fields[first_det[o] ? fd_col : ld_col];
+        if(y.empty() || day.empty() || y=="NA" || day=="NA") continue;
+        d = (int64_t)std::atoi(y.c_str())*100000000 + (int64_t)std::atoi(day.c_str())*100000;
+      }
+      int64_t &best = det[(size_t)o*n_fish + f->second];
+      if(best==none || (first_det[o] ? d<best : d>best)) best = d;
+    }
+  }
+
+  //year and day of year columns of each occasion, the fish whose detections changed or are new, and the records of the store
+  //(a fish only changes if the year or day of a detection changes, as the time of day isn't in the capture histories)
+  std::vector<bool> changed(n_fish,false);
+  for(size_t j=0; j<det.size(); j++) if((det[j]==none ? none : det[j]/100000)!=(det_prev[j]==none ? none : det_prev[j]/100000)) changed[j%n_fish] = true;
+  det_store_writer w;
+  if(!append){
+    w.bytes(det_store_magic,8);
+    w.bytes(&det_store_version,4);
+    uint32_t n = n_occ;
+    w.bytes(&n,4);
+  }
+  Rcpp::List out(2*n_occ);
+  Rcpp::CharacterVector names(2*n_occ);
+  for(int o=0; o<n_occ; o++){
+    for(int i=0; i<n_fish; i++){
+      if(det[(size_t)o*n_fish + i]!=det_prev[(size_t)o*n_fish + i]) w.record(tag[i], o, det[(size_t)o*n_fish + i]);
+    }
+    Rcpp::IntegerVector year(n_rows), doy(n_rows);
+    for(int i=0; i<n_rows; i++){
+      int64_t d = det[(size_t)o*n_fish + row_fish[i]];
+      year[i] = d==none ? NA_INTEGER : (int)(d/100000000);
+      doy[i] = d==none ? NA_INTEGER : (int)((d/100000)%1000);
+    }
+    out[2*o] = year;
+    out[2*o+1] = doy;
+    names[2*o] = occasions[o];
+    names[2*o+1] = Rcpp::as<std::string>(occasions[o]) + "_doy";
+  }
+  out.attr("names") = names;
+  std::vector<int> changed_fish, new_fish;
+  for(int i=0; i<n_fish; i++) if(!known[i]) w.record(tag[i], -1, 0);
+  for(int i=0; i<n_rows; i++){
+    if(changed[row_fish[i]]) changed_fish.push_back(i+1);
+    if(!known[row_fish[i]]) new_fish.push_back(i+1);
+  }
+  out.attr("changed") = Rcpp::wrap(changed_fish);
+  out.attr("new") = Rcpp::wrap(new_fish);
+  Rcpp::RawVector records(w.buf.size());
+  if(!w.buf.empty()) std::memcpy(records.begin(), w.buf.data(), w.buf.size());
+  out.attr("records") = records;
+  return out;
+}
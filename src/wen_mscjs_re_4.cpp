@@ -1,4 +1,10 @@
 #include <TMB.hpp>
+#include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include "ctr_rng.hpp"
 
  
 //Multistate model for  salmon in the Columbia River
@@ -51,6 +57,52 @@ enum valid_covStruct {
   pc_covstruct = 9
 };
 
+//pointer to the memory of an R vector or matrix if it is stored as T (numeric as double, integer as int, raw as unsigned char), else NULL
+template<class T> const T* r_memory(SEXP x){return NULL;}
+template<> const double* r_memory<double>(SEXP x){return TYPEOF(x)==REALSXP ? REAL(x) : NULL;}
+template<> const int* r_memory<int>(SEXP x){return TYPEOF(x)==INTSXP ? INTEGER(x) : NULL;}
+template<> const unsigned char* r_memory<unsigned char>(SEXP x){return TYPEOF(x)==RAWSXP ? RAW(x) : NULL;}
+
+//read only view of an R vector or matrix (column major) of T. If the R object is stored as T its memory is used directly, so large
+//data are not copied for each objective function (tape and thread), otherwise the view holds one converted copy (shared by copies of the view).
+//ld is the leading dimension (rows of the viewed matrix), so a view can be a block of rows.
+template<class T>
+struct data_view {
+  const T *x;
+  int nr, nc, ld;
+  std::shared_ptr<std::vector<T> > own;
+
+  data_view(): x(NULL), nr(0), nc(0), ld(0) {}
+  data_view(SEXP s): nr(nrows(s)), nc(ncols(s)), ld(nr) {
+    x = r_memory<T>(s);
+    if(x==NULL){
+      own = std::make_shared<std::vector<T> >(nr*nc);
+      for(int i=0; i<nr*nc; i++){
+        (*own)[i] = (TYPEOF(s)==REALSXP) ? T(REAL(s)[i]) : (TYPEOF(s)==INTSXP) ? T(INTEGER(s)[i]) : T(RAW(s)[i]);
+      }
+      x = own->data();
+    }
+  }
+  //copy of a matrix (e.g., for data that outlive the R object)
+  template<class Derived>
+  data_view(const Eigen::MatrixBase<Derived> &m): nr(m.rows()), nc(m.cols()), ld(nr) {
+    own = std::make_shared<std::vector<T> >(nr*nc);
+    Eigen::Map<Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic> >(own->data(),nr,nc) = m;
+    x = own->data();
+  }
+  //view of rows from, ..., from+n_rows-1 of a m_rows x m_cols matrix in memory that outlives the view (e.g., data of the objective function)
+  data_view(const T *m, int m_rows, int m_cols, int from, int n_rows): x(m+from), nr(n_rows), nc(m_cols), ld(m_rows) {}
+
+  T operator()(int i, int j) const {return x[i+j*ld];}
+  T operator()(int i) const {return x[i];}
+  int rows() const {return nr;}
+  int cols() const {return nc;}
+  int size() const {return nr*nc;}
+  Eigen::Map<const Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic>, 0, Eigen::OuterStride<> > mat() const {
+    return Eigen::Map<const Eigen::Matrix<T,Eigen::Dynamic,Eigen::Dynamic>, 0, Eigen::OuterStride<> >(x,nr,nc,Eigen::OuterStride<>(ld));
+  }
+};
+
 //defines elements of list data structure
 template <class Type>
 struct per_term_info {
@@ -59,8 +111,8 @@ struct per_term_info {
   int blockSize;     // Size of one block
   int blockReps;     // Repeat block number of times
   int blockNumTheta; // Parameter count per block
-  matrix<Type> dist;
-  vector<Type> times;// For ar1 case
+  data_view<double> dist;
+  data_view<double> times;// For ar1 case
   // Report output
   matrix<Type> corr;
   vector<Type> sd;
@@ -87,13 +139,13 @@ struct terms_t : vector<per_term_info<Type> > {
       SEXP t = getListElement(y, "times");
       if(!isNull(t)){
         RObjectTestExpectedType(t, &isNumeric, "times");
-        (*this)(i).times = asVector<Type>(t);
+        (*this)(i).times = data_view<double>(t);
       }
       // Optionally, pass distance matrix:
       SEXP d = getListElement(y, "dist");
       if(!isNull(d)){
         RObjectTestExpectedType(d, &isMatrix, "dist");
-        (*this)(i).dist = asMatrix<Type>(d);
+        (*this)(i).dist = data_view<double>(d);
       }
     }
   }
@@ -259,7 +311,7 @@ Type termwise_nll(array<Type> &U, vector<Type> theta, per_term_info<Type>& term,
         term.sd(i) = sd;
         for(int j=0; j<n; j++){
           term.corr(i,j) =
-            exp(-exp(corr_transf) * CppAD::abs(term.times(i) - term.times(j)));
+            exp(-exp(corr_transf) * CppAD::abs(Type(term.times(i) - term.times(j))));
         }
       }
     }
@@ -269,7 +321,7 @@ Type termwise_nll(array<Type> &U, vector<Type> theta, per_term_info<Type>& term,
            term.blockCode == gau_covstruct ||
            term.blockCode == mat_covstruct){
     int n = term.blockSize;
-    matrix<Type> dist = term.dist;
+    matrix<Type> dist = term.dist.mat().template cast<Type>();
     if(! ( dist.cols() == n && dist.rows() == n ) )
       error ("Dimension of distance matrix must equal blocksize.");
     // First parameter is sd
@@ -339,23 +391,1221 @@ Type allterms_nll(vector<Type> &u, vector<Type> theta,
   return ans;
 }
 
-// data structure that holds the parameter index matrices
+// data structure that holds the parameter index matrices (viewing the R matrices, which are not copied if stored as integers)
 template<class Type>
-struct pim: vector<matrix<int> > {
+struct pim: vector<data_view<int> > {
 
   pim(SEXP x){ // Constructor
     (*this).resize(LENGTH(x));
     for(int i=0; i<LENGTH(x); i++){
       SEXP m = VECTOR_ELT(x, i);
-    (*this)(i) = asMatrix<int>(m);
+    (*this)(i) = data_view<int>(m);
+    }
+
+  }
+};
+
+// data structure that holds an index matrix or vector (e.g., the simulation PIMs)
+template<class Type>
+struct index_view: data_view<int> {
+  index_view(SEXP x): data_view<int>(x) {}
+};
+
+//capture histories as 1 byte codes (0 not detected, k detected in state k), which take a quarter of the memory (and cache) of integers
+typedef Eigen::Matrix<unsigned char,Eigen::Dynamic,Eigen::Dynamic> ch_codes;
+
+// data structure that holds the capture histories, read from a numeric, integer, or raw matrix
+template<class Type>
+struct ch_matrix: ch_codes {
+
+  ch_matrix(SEXP x): ch_codes(data_view<unsigned char>(x).mat()) {} // Constructor
+};
+
+//function that calculates the fixed component of a linear predictor. As in glmmTMB, the fixed effect design matrix
+//is either dense (X) or sparse (XS), and an empty (0 x 0) X indicates that XS is used.
+template<class Type>
+vector<Type> fixed_eta(matrix<Type> &X, Eigen::SparseMatrix<Type> &XS, vector<Type> &beta){
+  if(X.rows()==0 && X.cols()==0) return XS*beta;
+  return X*beta;
+}
+
+//individual covariate effects on phi or p. At occasion t with ind_occ(t)>=0, row r of the PIMs adds X_ind.row(r) times column ind_occ(t) 
+//of beta_ind to the group-level linear predictor, i.e., its probability is q = x*E/(1-x+x*E) for group-level probability x, where 
+//E = exp(X_ind*beta_ind) holds the odds ratios of each row of the PIMs (rows) in each set of occasions (columns). X_ind has a column 
+//per covariate (SoA), so E is one vectorized product per evaluation, and q is calculated where the likelihood uses it (see fwd_prob).
+template<class Type>
+struct ind_odds {
+  const Type *E;    // odds ratios (column major), or NULL if there are no individual covariates
+  int n_rows;       // rows of E (rows of the PIMs)
+  const int *occ;   // column of E used at each occasion, or -1
+  int n_occ;
+  int n_eta;        // parameters below n_eta have individual effects (not the fixed p on the final occasion)
+
+  ind_odds(): E(NULL), n_rows(0), occ(NULL), n_occ(0), n_eta(0) {}
+  ind_odds(const Type *E, int n_rows, const int *occ, int n_occ, int n_eta): E(E), n_rows(n_rows), occ(occ), n_occ(n_occ), n_eta(n_eta) {}
+  //index in E of the odds ratio of parameter i in row r at occasion t, or -1 if it has no individual effect
+  int at(int i, int r, int t) const {
+    return (E!=NULL && t<n_occ && occ[t]>=0 && i>=0 && i<n_eta) ? r+occ[t]*n_rows : -1;
+  }
+};
+
+//function that returns the odds ratios exp(X_ind*beta_ind) of the individual covariate effects (empty if X_ind has no columns)
+template<class Type>
+matrix<Type> ind_odds_ratio(matrix<Type> &X_ind, matrix<Type> &beta_ind){
+  if(X_ind.cols()==0 || beta_ind.cols()==0) return matrix<Type>(0,0);
+  matrix<Type> XB = X_ind*beta_ind;
+  return exp(XB.array()).matrix();
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Forward algorithm for the capture history likelihood
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+//valid likelihood engines
+enum valid_likEngine {
+  ch_engine    = 0, // forward algorithm run separately for each unique capture history
+  trie_engine  = 1, // forward algorithm run once per node of a prefix trie of capture histories within each group
+  batch_engine = 2, // forward algorithm run on blocks of capture histories at a time in double precision (see fwd_batch)
+  atomic_engine = 3 // forward algorithm run as one atomic function with a hand-coded reverse pass (see fwd_nll_deriv)
+};
+
+//the engines multiply the u's into a running product and add its log to the NLL only after occasions t with
+//(t+1)%log_every==0 and after the final occasion. Each u is at least the smallest detection/ survival/ maturation 
+//probability, so the product cannot underflow over this many occasions. The interval is fixed by occasion 
+//(rather than by the value of the product) so the AD tape does not depend on the parameters.
+const int log_every = 8;
+
+//The forward algorithm is templated on the number of adult return states K (n_states), so for the values of K in FWD_STATES
+//the state probabilities (dead, 1, ..., K) are fixed size arrays on the stack and loops over states are unrolled by the compiler.
+//Other numbers of states use dynamic size arrays (K = Eigen::Dynamic).
+template<class Type, int K>
+struct fwd_types {
+  enum { S = (K==Eigen::Dynamic ? int(Eigen::Dynamic) : K+1) }; // number of states including dead
+  typedef Eigen::Array<Type,S,1> vec; // state probabilities
+  typedef Eigen::Array<Type,S,S> mat; // transition matrix
+  typedef Eigen::Array<int,S,1> ivec;
+};
+
+//function that returns the number of adult return states K, which is known at compile time unless K is Eigen::Dynamic
+template<int K>
+inline int fwd_n_states(int n_states){
+  return K==Eigen::Dynamic ? n_states : K;
+}
+
+//calls the statements in ... with the compile time constant K equal to n_states, e.g., FWD_STATES(n_states, u=fwd_step<Type,K>(...)).
+#define FWD_STATES(n_states, ...)                                   \
+  switch(n_states){                                                 \
+    case 1: { const int K=1; __VA_ARGS__; } break;                  \
+    case 2: { const int K=2; __VA_ARGS__; } break;                  \
+    case 3: { const int K=3; __VA_ARGS__; } break;                  \
+    case 4: { const int K=4; __VA_ARGS__; } break;                  \
+    case 5: { const int K=5; __VA_ARGS__; } break;                  \
+    default: { const int K=Eigen::Dynamic; __VA_ARGS__; } break;    \
+  }
+
+//function that backtransforms the multinomial logit linear predictors of maturation age to the probability of each adult return
+//state (columns) in each group (rows). eta_psi holds n_states-1 blocks of n_groups rows, one for each state except the reference
+//state (state 2, return after 2 years, or state 1 if there is only one state), in order of state.
+template<class Type>
+matrix<Type> psi_mlogit(vector<Type> eta_psi, int n_groups, int n_states){
+  matrix<Type> psi(n_groups,n_states);
+  int ref = n_states>1 ? 1 : 0;
+  eta_psi = exp(eta_psi);
+  vector<Type> denom(n_groups);
+  denom.setZero();
+  for(int b=0; b<(n_states-1); b++) denom += eta_psi.segment(b*n_groups,n_groups);
+  denom += Type(1);
+  for(int k=0, b=0; k<n_states; k++){
+    if(k==ref){
+      psi.col(k)= Type(1)/denom;
+    }else{
+      psi.col(k)= eta_psi.segment(b*n_groups,n_groups)/denom;
+      b++;
+    }
+  }
+  return psi;
+}
+
+//probabilities of phi or p (x, with complements x_c = 1-x) for each row of the PIMs, state (k = 0 is state 1, or the single 
+//downstream state), and occasion, including individual covariate effects (ind). The engines read them through this, so the PIMs
+//and parameter vectors are the same with or without individual covariates.
+template<class Type>
+struct fwd_prob {
+  const Type *x, *x_c;
+  const vector<data_view<int> > *pim;
+  ind_odds<Type> ind;
+
+  fwd_prob(const Type *x, const Type *x_c, const vector<data_view<int> > &pim, const ind_odds<Type> &ind): x(x), x_c(x_c), pim(&pim), ind(ind) {}
+  int index(int k, int r, int t) const {return (*pim)(k)(r,t);}
+  Type operator()(int k, int r, int t) const {
+    int i=index(k,r,t), e=ind.at(i,r,t);
+    if(e<0) return x[i];
+    return x[i]*ind.E[e]/(x_c[i]+x[i]*ind.E[e]);
+  }
+  //complement
+  Type c(int k, int r, int t) const {
+    int i=index(k,r,t), e=ind.at(i,r,t);
+    if(e<0) return x_c[i];
+    return x_c[i]/(x_c[i]+x[i]*ind.E[e]);
+  }
+  //log of the probability and of its complement, looked up in the logs of the group-level probabilities (log_x and log_x_c) 
+  //where there are no individual effects
+  Type log_at(const vector<Type> &log_x, int k, int r, int t) const {
+    int i=index(k,r,t);
+    return ind.at(i,r,t)<0 ? log_x(i) : Type(log((*this)(k,r,t)));
+  }
+  Type log_c(const vector<Type> &log_x_c, int k, int r, int t) const {
+    int i=index(k,r,t);
+    return ind.at(i,r,t)<0 ? log_x_c(i) : Type(log(c(k,r,t)));
+  }
+  //adds g times the gradient of the probability with respect to x and E to dx and dE
+  void grad(int k, int r, int t, Type g, Type *dx, Type *dE) const {
+    int i=index(k,r,t), e=ind.at(i,r,t);
+    if(e<0){
+      dx[i]+=g;
+      return;
+    }
+    Type den=x_c[i]+x[i]*ind.E[e];
+    g/=den*den;
+    dx[i]+=g*ind.E[e];
+    dE[e]+=g*x[i]*x_c[i];
+  }
+};
+
+//function that advances the state probabilities pS of a capture history across occasion t, where n is its row of the PIMs and Psi_pim.
+//Applies survival (and maturation on the ocean occasion) to occasion t, then the observation obs at occasion t.
+//Normalizes pS and returns the sum of the probabilities before normalizing (u), so log(u) is the contribution to the log likelihood.
+//phi and p include the complements (1-phi and 1-p), calculated once per evaluation, and individual covariate effects (see fwd_prob).
+template<class Type, int K>
+Type fwd_step(typename fwd_types<Type,K>::vec &pS, int n, int t, int obs, int nDS_OCC, int n_OCC,
+              const fwd_prob<Type> &phi, const fwd_prob<Type> &p, matrix<Type> &psi, vector<int> &Psi_pim){
+  const int n_s = fwd_n_states<K>(pS.size()-1);
+  if(t<nDS_OCC){ //downstream migration
+    //survival process
+    pS(0) += Type(phi.c(0,n,t)*pS(1)); //prob die or stay dead
+    pS(1) *= Type(phi(0,n,t)); //prob stay alive
+    //observation process
+    if(obs){
+      pS(1) *= Type(p(0,n,t)); //prob detected given alive
+      pS(0) =  Type(0);        //prob detected given dead
+    }else{
+      pS(1) *= Type(p.c(0,n,t)); //prob not detected given alive
+    }
+  }else{
+    if(t==nDS_OCC){ //ocean occasion
+      ////survival process
+      pS(0) += Type(phi.c(0,n,t)*pS(1)); //prob die or stay dead in ocean
+      pS(1) *= Type(phi(0,n,t)); //prob survive ocean
+      //maturation age process
+      Type alive = pS(1);
+      for(int k=1; k<=n_s; k++) pS(k) = alive * psi(Psi_pim(n),k-1);
+    }else{ //upstream migration
+      ////survival process
+      for(int k=1; k<=n_s; k++){
+        pS(0) += Type(phi.c(k-1,n,t)*pS(k));
+        pS(k) *= Type(phi(k-1,n,t));
+      }
+    }
+    ////observation process (detection probability fixed at 1 on the final occasion)
+    if(!obs){
+      for(int k=1; k<=n_s; k++){
+        if(t<(n_OCC-1)){
+          pS(k) *= Type(p.c(k-1,n,t));
+        }else{
+          pS(k) =  Type(0);
+        }
+      }
+    }else{
+      Type tmp = pS(obs);
+      if(t<(n_OCC-1)) tmp *= p(obs-1,n,t);
+      pS.setZero();
+      pS(obs)=tmp;
+    }
+  }
+  Type u = pS.sum();  //sum of probs
+  pS = pS/u;          //normalize probs
+  return u;
+}
+
+//function that runs the forward algorithm over nodes from, ..., to-1 of the prefix trie of capture histories (see the trie engine
+//in the objective function), which are a chunk with its own trie, so parents are in the chunk and come before their children.
+//The state probabilities of the nodes are fixed size columns when K is known at compile time. The log(L) of each node, weighted
+//by the number of fish passing through it, is subtracted from lik_nll (chunked) or jnll, and the NLL up to each node is stored in NLL_node.
+template<class Type, int K>
+void fwd_trie(int from, int to, int n_states, int nDS_OCC, int n_OCC, vector<int> &trie_parent, vector<int> &trie_occ,
+              vector<int> &trie_obs, vector<int> &trie_row, vector<int> &trie_freq, vector<int> &ch_pim,
+              const fwd_prob<Type> &phi, const fwd_prob<Type> &p, matrix<Type> &psi, vector<int> &Psi_pim,
+              vector<Type> &NLL_node, bool chunked, Type &lik_nll, parallel_accumulator<Type> &jnll){
+  typename fwd_types<Type,K>::vec pS(n_states+1); //state probs: dead, 1, ..., K
+  Eigen::Array<Type,fwd_types<Type,K>::S,Eigen::Dynamic> pS_node(n_states+1,to-from); // state probs after the observation at each node
+  std::vector<Type> L_node(to-from); // running product of u since the last log at each node
+  Type NLL_it, L;
+  for(int i=from; i<to; i++){
+    int a = trie_parent(i);
+    if(a<0){
+      pS.setZero(); //initialize at 0,1,0,...,0 (conditioning at capture)
+      pS(1)=Type(1);
+      NLL_it=Type(0);
+      L=Type(1);
+    }else{
+      pS=pS_node.col(a-from);
+      NLL_it=NLL_node(a);
+      L=L_node[a-from];
+    }
+    L*=fwd_step<Type,K>(pS, ch_pim(trie_row(i)), trie_occ(i), trie_obs(i), nDS_OCC, n_OCC, phi, p, psi, Psi_pim);
+    pS_node.col(i-from)=pS;
+    if(((trie_occ(i)+1)%log_every==0) || (trie_occ(i)==(n_OCC-1))){
+      //every capture history passing through the node also passes through the ancestors whose u's are in L, and 
+      //the u's of the other descendants of those ancestors are in the L of their own nodes at this occasion, so 
+      //log(L) is multiplied by the number of fish passing through the node and subtracted from total jnll
+      NLL_it+=log(L);
+      if(chunked) lik_nll-=(log(L)*trie_freq(i)); else jnll-=(log(L)*trie_freq(i));
+      L=Type(1);
+    }
+    NLL_node(i)=NLL_it;
+    L_node[i-from]=L;
+  }
+}
+
+//function that returns the last occasion capture history n was detected (f-1 if never detected after release)
+template<class CHT>
+int last_detection(const CHT &CH, int n, int f){
+  int last=CH.cols()-1;
+  while(last>=f && !CH(n,last)) last--;
+  return last;
+}
+
+//function that returns the log likelihood of capture history (row of CH) n, with row r of the PIMs, with the forward algorithm. If chi is not NULL (the chi
+//table of the group of the capture history, see fwd_chi), the forward algorithm stops at the last detection and multiplies by the
+//probability of never being detected again.
+template<class Type, int K>
+Type fwd_ch_ll(int n, int r, int n_states, int nDS_OCC, int n_OCC, const ch_codes &CH, vector<int> &f,
+               const fwd_prob<Type> &phi, const fwd_prob<Type> &p, matrix<Type> &psi, vector<int> &Psi_pim, const Type *chi){
+  typename fwd_types<Type,K>::vec pS(n_states+1); //state probs: dead, 1, ..., K
+  pS.setZero(); //initialize at 0,1,0,...,0 (conditioning at capture)
+  pS(1)=Type(1);
+  Type NLL_it=0; // log likelihood of the capture history
+  Type L=1;      // running product of u since the last log was added to NLL_it
+  int last = chi ? last_detection(CH, n, f(n)) : n_OCC-1;
+  for(int t=f(n); t<=last; t++){ //loop over occasions (excluding capture occasion)
+    L *= fwd_step<Type,K>(pS, r, t, CH(n,t), nDS_OCC, n_OCC, phi, p, psi, Psi_pim);
+    if(((t+1)%log_every==0) || (!chi && t==(n_OCC-1))){
+      NLL_it  +=log(L);    //accumulate nll
+      L=Type(1);
+    }
+  }
+  if(chi){
+    int k = last>=f(n) ? CH(n,last) : 1; // state after the last detection or release
+    NLL_it  +=log(L*chi[n_states*(last+1)+k-1]); //never detected again
+  }
+  return NLL_it;
+}
+
+//function that fills in the probabilities of never being detected again (chi) for the group of capture histories using row n of the PIMs.
+//chi[n_states*(t+1)+k-1] is the probability that a fish in state k after occasion t (t=-1 for release before occasion 0) is not detected
+//on any later occasion, summed over survival and the maturation age split on the ocean occasion. Detection probability is fixed at 1
+//on the final occasion, so this is the probability of dying before being detected again. Only state 1 is used before the ocean occasion.
+//psi is column major (psi[g+(k-1)*n_groups] is the prob of maturing into state k in group g).
+template<class Type, class Index>
+void fwd_chi(int n, int n_states, int nDS_OCC, int n_OCC, int n_groups, const fwd_prob<Type> &phi, const fwd_prob<Type> &p, const Type *psi,
+             const Index &Psi_pim, Type *chi){
+  for(int k=0; k<n_states; k++) chi[n_states*n_OCC+k]=Type(1); //nothing left to detect after the final occasion
+  for(int t=(n_OCC-2); t>=-1; t--){
+    int s=t+1; //next occasion
+    Type *c=&chi[n_states*(t+1)];
+    const Type *c_next=&chi[n_states*(s+1)];
+    for(int k=0; k<n_states; k++) c[k]=Type(0);
+    if(s<nDS_OCC){ //downstream migration
+      c[0]=phi.c(0,n,s)+phi(0,n,s)*p.c(0,n,s)*c_next[0];
+    }else if(s==nDS_OCC){ //ocean occasion
+      int g=Psi_pim(n);
+      Type tmp=0;
+      for(int k=0; k<n_states; k++){
+        Type q = s<(n_OCC-1) ? p.c(k,n,s) : Type(0); //prob not detected at s
+        tmp+=psi[g+k*n_groups]*q*c_next[k];
+      }
+      c[0]=phi.c(0,n,s)+phi(0,n,s)*tmp;
+    }else{ //upstream migration
+      for(int k=0; k<n_states; k++){
+        Type q = s<(n_OCC-1) ? p.c(k,n,s) : Type(0);
+        c[k]=phi.c(k,n,s)+phi(k,n,s)*q*c_next[k];
+      }
+    }
+  }
+}
+
+//function that adds the gradient of the chi of a group with respect to phi, p, and psi to dphi, dp, and dpsi (and with respect to the
+//odds ratios of individual covariates to dE_phi and dE_p), given the derivatives of the output with respect to chi (dchi, which is 
+//overwritten with the derivatives through the later chi's). chi is from fwd_chi.
+template<class Type, class Index>
+void fwd_chi_reverse(int n, int n_states, int nDS_OCC, int n_OCC, int n_groups, const fwd_prob<Type> &phi, const fwd_prob<Type> &p, 
+                     const Type *psi, const Index &Psi_pim, const Type *chi, Type *dchi, 
+                     Type *dphi, Type *dE_phi, Type *dp, Type *dE_p, Type *dpsi){
+  for(int t=-1; t<=(n_OCC-2); t++){ //chi at t depends on chi at t+1, so its derivative is complete before passing it on
+    int s=t+1;
+    const Type *g=&dchi[n_states*(t+1)], *c_next=&chi[n_states*(s+1)];
+    Type *g_next=&dchi[n_states*(s+1)];
+    if(s<nDS_OCC){
+      Type ph=phi(0,n,s), q=p.c(0,n,s);
+      phi.grad(0, n, s, g[0]*(q*c_next[0]-Type(1)), dphi, dE_phi);
+      p.grad(0, n, s, -g[0]*ph*c_next[0], dp, dE_p);
+      g_next[0]+=g[0]*ph*q;
+    }else if(s==nDS_OCC){
+      int gr=Psi_pim(n);
+      Type ph=phi(0,n,s), tmp=0;
+      for(int k=0; k<n_states; k++){
+        Type q = s<(n_OCC-1) ? p.c(k,n,s) : Type(0);
+        Type psi_k=psi[gr+k*n_groups];
+        tmp+=psi_k*q*c_next[k];
+        dpsi[gr+k*n_groups]+=g[0]*ph*q*c_next[k];
+        if(s<(n_OCC-1)) p.grad(k, n, s, -g[0]*ph*psi_k*c_next[k], dp, dE_p);
+        g_next[k]+=g[0]*ph*psi_k*q;
+      }
+      phi.grad(0, n, s, g[0]*(tmp-Type(1)), dphi, dE_phi);
+    }else{
+      for(int k=0; k<n_states; k++){
+        Type ph=phi(k,n,s);
+        Type q = s<(n_OCC-1) ? p.c(k,n,s) : Type(0);
+        phi.grad(k, n, s, g[k]*(q*c_next[k]-Type(1)), dphi, dE_phi);
+        if(s<(n_OCC-1)) p.grad(k, n, s, -g[k]*ph*c_next[k], dp, dE_p);
+        g_next[k]+=g[k]*ph*q;
+      }
+    }
+  }
+}
+
+//function that runs the forward algorithm on a block of B capture histories (rows n0 to n0+B-1) at once.
+//CH and the PIMs are column major, so the rows of a block are adjacent in memory for each occasion, and the state
+//probabilities are held as pS(state,history). Release occasions and observations are applied as 0/1 masks instead of
+//branches, so the loops over histories have no branches and can be vectorized (e.g., when Type is double in REPORT and SIMULATE).
+//Rows past the last capture history (n_unique_CH) are evaluated for the last capture history and given a frequency of 0.
+//Returns the sum of the frequency weighted log likelihoods and fills in the log likelihood of each capture history in NLL_it_vec.
+template<class Type, int K, int B>
+Type fwd_batch(int n0, int n_states, int nDS_OCC, int n_OCC, const ch_codes &CH, vector<int> &f, vector<int> &freq,
+               const fwd_prob<Type> &phi, const fwd_prob<Type> &p, matrix<Type> &psi, vector<int> &Psi_pim, vector<int> &pim_row, 
+               vector<Type> &NLL_it_vec){
+  typedef Eigen::Array<Type,fwd_types<Type,K>::S,B> state_block;
+  const int n_s = fwd_n_states<K>(n_states);
+  int n_unique_CH = CH.rows();
+  int row[B];       // row of CH of each history in the block
+  int prow[B];      // row of PIMs of each history in the block
+  Type w[B];        // frequency of each history in the block
+  state_block pS(n_s+1,B);     // state probs: dead, 1, ..., K
+  state_block pS_new(n_s+1,B);
+  Type NLL_it[B];
+  Type L[B];        // running product of u since the last log
+  Type act[B];      // 1 if history has been released by occasion t
+  state_block obs(n_s+1,B);    // 1 if history observed in state at occasion t
+  for(int l=0; l<B; l++){
+    row[l] = (n0+l<n_unique_CH) ? (n0+l) : (n_unique_CH-1);
+    prow[l] = pim_row(row[l]);
+    w[l] = (n0+l<n_unique_CH) ? Type(freq(row[l])) : Type(0);
+    for(int k=0; k<=n_s; k++) pS(k,l)=Type(k==1); //initialize at 0,1,0,...,0 (conditioning at capture)
+    NLL_it[l]=Type(0);
+    L[l]=Type(1);
+  }
+
+  for(int t=0; t<n_OCC; t++){ //loop over occasions
+    for(int l=0; l<B; l++){
+      act[l] = Type(f(row[l])<=t);
+      for(int k=0; k<=n_s; k++) obs(k,l) = Type(CH(row[l],t)==k);
+    }
+    if(t<nDS_OCC){ //downstream migration
+      for(int l=0; l<B; l++){
+        //survival process
+        pS_new(0,l) = pS(0,l) + phi.c(0,prow[l],t)*pS(1,l);
+        pS_new(1,l) = pS(1,l) * phi(0,prow[l],t);
+        //observation process
+        pS_new(1,l) *= p(0,prow[l],t)*obs(1,l) + p.c(0,prow[l],t)*obs(0,l);
+        pS_new(0,l) *= obs(0,l);
+        for(int k=2; k<=n_s; k++) pS_new(k,l) = Type(0);
+      }
+    }else{
+      if(t==nDS_OCC){ //ocean occasion
+        for(int l=0; l<B; l++){
+          ////survival process
+          pS_new(0,l) = pS(0,l) + phi.c(0,prow[l],t)*pS(1,l);
+          Type alive = pS(1,l) * phi(0,prow[l],t);
+          //maturation age process
+          for(int k=1; k<=n_s; k++) pS_new(k,l) = alive * psi(Psi_pim(prow[l]),k-1);
+        }
+      }else{ //upstream migration
+        for(int l=0; l<B; l++){
+          ////survival process
+          pS_new(0,l) = pS(0,l);
+          for(int k=1; k<=n_s; k++){
+            pS_new(0,l) += phi.c(k-1,prow[l],t)*pS(k,l);
+            pS_new(k,l) = pS(k,l) * phi(k-1,prow[l],t);
+          }
+        }
+      }
+      ////observation process (detection probability fixed at 1 on the final occasion)
+      for(int l=0; l<B; l++){
+        for(int k=1; k<=n_s; k++){
+          if(t<(n_OCC-1)){
+            pS_new(k,l) *= p.c(k-1,prow[l],t)*obs(0,l) + p(k-1,prow[l],t)*obs(k,l);
+          }else{
+            pS_new(k,l) *= obs(k,l);
+          }
+        }
+        pS_new(0,l) *= obs(0,l);
+      }
+    }
+    //accumulate NLL and normalize probs, leaving histories not yet released at 0,1,0,...,0
+    for(int l=0; l<B; l++){
+      Type u = pS_new.col(l).sum();
+      u = act[l]*u + (Type(1)-act[l]);
+      Type scale = act[l]/u;
+      for(int k=0; k<=n_s; k++) pS(k,l) = scale*pS_new(k,l) + (Type(1)-act[l])*pS(k,l);
+      L[l] *= u;
+    }
+    if(((t+1)%log_every==0) || (t==(n_OCC-1))){
+      for(int l=0; l<B; l++){
+        NLL_it[l] += log(L[l]);
+        L[l] = Type(1);
+      }
+    }
+  }
+
+  Type ans = 0;
+  for(int l=0; l<B; l++){
+    ans += NLL_it[l]*w[l];
+    if(n0+l<n_unique_CH) NLL_it_vec(n0+l)=NLL_it[l];
+  }
+  return ans;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// AD tape accounting
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+//sections of the objective function for tape accounting (rows of tape_sections)
+enum valid_tapeSection {
+  linpred_section = 0, // linear predictors and links
+  prior_section   = 1, // priors on penalty rates and PC priors on coefficients
+  re_phi_section  = 2, // random effects for phi (allterms_nll)
+  re_p_section    = 3, // random effects for p (allterms_nll)
+  re_psi_section  = 4, // random effects for psi (allterms_nll)
+  lik_section     = 5, // capture history likelihood (forward algorithm and m-array)
+  report_section  = 6, // REPORT and ADREPORT blocks
+  n_tape_sections = 7
+};
+
+//function that returns the number of operations, values, and inputs on the AD tape being recorded, and the bytes they take up.
+//Returns zeros when not recording (Type is double) or when the AD framework is not TMBad.
+template<class Type>
+vector<double> tape_size(){
+  vector<double> ans(4);
+  ans.setZero();
+#ifdef TMBAD_FRAMEWORK
+  TMBad::global *glob = TMBad::get_glob();
+  if(!isDouble<Type>::value && glob!=NULL){
+    ans(0) = glob->opstack.size();
+    ans(1) = glob->values.size();
+    ans(2) = glob->inputs.size();
+    ans(3) = ans(0)*sizeof(void*) + ans(1)*sizeof(TMBad::Scalar) + ans(2)*sizeof(TMBad::Index);
+  }
+#endif
+  return ans;
+}
+
+//tape used by each section in the most recent taping of the objective function, for each parallel region (each thread records its
+//own tape). Tapes are recorded by MakeADFun (and again by sdreport for ADREPORT), while REPORT is evaluated in double precision, so the
+//counts are kept here between the two.
+inline std::vector<matrix<double> >& tape_sections_store(){
+  static std::vector<matrix<double> > store;
+  return store;
+}
+
+//structure that accumulates the growth of the tape (operations, values, inputs, bytes) between calls to mark()
+template<class Type>
+struct tape_accountant {
+  vector<double> last;
+  matrix<double> sections;
+  tape_accountant(){
+    last = tape_size<Type>();
+    sections = matrix<double>::Zero(n_tape_sections,4);
+  }
+  //attribute the tape recorded since the last mark to section
+  void mark(int section){
+    vector<double> now = tape_size<Type>();
+    for(int j=0; j<4; j++) sections(section,j) += now(j)-last(j);
+    last = now;
+  }
+  //save the counts of parallel region (-1 if not taped in parallel, of n_regions) if a tape was recorded, and return the counts from
+  //the most recent taping summed over the regions
+  matrix<double> save(int region, int n_regions){
+    matrix<double> total = matrix<double>::Zero(n_tape_sections,4);
+    #pragma omp critical (tape_sections_store)
+    {
+      std::vector<matrix<double> > &store = tape_sections_store();
+      if(!isDouble<Type>::value){
+        store.resize(std::max(n_regions,1), matrix<double>::Zero(n_tape_sections,4));
+        store[std::max(region,0)] = sections;
+      }
+      for(size_t i=0; i<store.size(); i++) total += store[i];
+    }
+    return total;
+  }
+};
+
+//forward mode dual number x.v + x.d*eps (eps^2 = 0) with values and derivatives of type T. Nesting them (fwd_dual<fwd_dual<double> >, ...)
+//gives mixed directional derivatives of any order of code written for a generic Type, which is used for the derivatives of fwd_nll_deriv.
+template<class T>
+struct fwd_dual {
+  T v, d;
+  fwd_dual(): v(0.0), d(0.0) {}
+  fwd_dual(double x): v(x), d(0.0) {}
+  fwd_dual(const T &v_, const T &d_): v(v_), d(d_) {}
+  fwd_dual& operator+=(const fwd_dual &y){v+=y.v; d+=y.d; return *this;}
+  fwd_dual& operator-=(const fwd_dual &y){v-=y.v; d-=y.d; return *this;}
+  fwd_dual& operator*=(const fwd_dual &y){d=d*y.v+v*y.d; v*=y.v; return *this;}
+  fwd_dual& operator/=(const fwd_dual &y){v/=y.v; d=(d-v*y.d)/y.v; return *this;}
+};
+template<class T> fwd_dual<T> operator+(fwd_dual<T> x, const fwd_dual<T> &y){return x+=y;}
+template<class T> fwd_dual<T> operator-(fwd_dual<T> x, const fwd_dual<T> &y){return x-=y;}
+template<class T> fwd_dual<T> operator*(fwd_dual<T> x, const fwd_dual<T> &y){return x*=y;}
+template<class T> fwd_dual<T> operator/(fwd_dual<T> x, const fwd_dual<T> &y){return x/=y;}
+template<class T> fwd_dual<T> operator-(const fwd_dual<T> &x){return fwd_dual<T>(-x.v,-x.d);}
+template<class T> fwd_dual<T> log(const fwd_dual<T> &x){
+  using std::log;
+  return fwd_dual<T>(log(x.v), x.d/x.v);
+}
+template<class T> fwd_dual<T> exp(const fwd_dual<T> &x){
+  using std::exp;
+  T e=exp(x.v);
+  return fwd_dual<T>(e, x.d*e);
+}
+
+//number of nested fwd_duals in T (the order of the derivatives), the value of T with its j-th level of nesting seeded with direction 
+//v[j-1] (element i), and the coefficient of the product of all the eps's (the mixed derivative in all the directions)
+template<class T>
+struct fwd_dual_order {
+  enum { order = 0 };
+  static T seed(double x, const double * const *v, int i){return T(x);}
+  static double top(const T &x){return x;}
+};
+template<class T>
+struct fwd_dual_order<fwd_dual<T> > {
+  enum { order = fwd_dual_order<T>::order+1 };
+  static fwd_dual<T> seed(double x, const double * const *v, int i){return fwd_dual<T>(fwd_dual_order<T>::seed(x,v,i), T(v[order-1][i]));}
+  static double top(const fwd_dual<T> &x){return fwd_dual_order<T>::top(x.d);}
+};
+
+//highest order of the directional derivatives of the gradient in fwd_nll_deriv (i.e., derivatives of the NLL up to order fwd_max_order+1)
+const int fwd_max_order = 3;
+
+//data for the forward algorithm atomic function (fwd_nll_deriv). An atomic function only takes a vector of Types, so the capture history
+//data are held by a shared pointer. With TMBad the pointer is held by the operators on the tapes (fwd_nll_op), so the data are freed with
+//the last tape (ADFun) that uses them, and the registry only keeps weak pointers keyed by a hash of the data, so the model taped again
+//with the same data (e.g., for each thread, or by sdreport) shares them. With CppAD, whose atomic functions cannot hold data, the 
+//registry also keeps the data at index id, which is the first element of the input vector.
+struct fwd_ch_data {
+  int n_states, nDS_OCC, n_OCC, n_groups, n_phi, n_p, n_par;
+  int n_cov, n_set_phi, n_set_p; // individual covariates, and sets of occasions of their phi and p coefficients
+  // copies if registered, since the data outlive the R data, otherwise views of the data of the objective function (see fwd_ch_view)
+  data_view<unsigned char> CH;
+  data_view<int> f, freq, Psi_pim;
+  data_view<int> pim_row;                 // row of the PIMs and Psi_pim of each capture history (empty if it is the row of the CH)
+  vector<data_view<int> > Phi_pim, p_pim;
+  data_view<double> X_ind;                // individual covariates of each row of the PIMs (no columns if there are none)
+  vector<int> ind_phi_occ, ind_p_occ;     // set of coefficients used at each occasion (see ind_odds)
+  vector<int> last;    // last detection of each capture history (if the chi tables are used)
+  vector<int> chi_grp; // group of PIM rows of each capture history, numbered within these data (empty if chi tables are not used)
+  vector<int> chi_row; // a capture history in each group
+  uint64_t hash;       // hash of the above
+  int id;              // index in the registry (CppAD)
+  
+  int row(int n) const {return pim_row.size()>0 ? pim_row(n) : n;} // row of the PIMs of capture history n
+};
+typedef std::shared_ptr<const fwd_ch_data> fwd_ch_ptr;
+
+//function that adds n bytes at x to the 64 bit FNV-1a hash h
+inline uint64_t fnv_hash(uint64_t h, const void *x, size_t n){
+  const unsigned char *c = (const unsigned char*)x;
+  for(size_t i=0; i<n; i++){
+    h ^= c[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//function that returns the hash of capture history data
+inline uint64_t fwd_ch_hash(const fwd_ch_data &d){
+  int dims[10] = {d.n_states, d.nDS_OCC, d.n_OCC, d.n_groups, d.n_phi, d.n_p, int(d.CH.rows()), d.n_cov, d.n_set_phi, d.n_set_p};
+  uint64_t h = fnv_hash(14695981039346656037ULL, dims, sizeof(dims));
+  h = fnv_hash(h, d.CH.x, d.CH.size());
+  h = fnv_hash(h, d.f.x, d.f.size()*sizeof(int));
+  h = fnv_hash(h, d.freq.x, d.freq.size()*sizeof(int));
+  h = fnv_hash(h, d.Psi_pim.x, d.Psi_pim.size()*sizeof(int));
+  h = fnv_hash(h, d.pim_row.x, d.pim_row.size()*sizeof(int));
+  h = fnv_hash(h, d.chi_grp.data(), d.chi_grp.size()*sizeof(int));
+  for(int k=0; k<d.Phi_pim.size(); k++) h = fnv_hash(h, d.Phi_pim(k).x, d.Phi_pim(k).size()*sizeof(int));
+  for(int k=0; k<d.p_pim.size(); k++) h = fnv_hash(h, d.p_pim(k).x, d.p_pim(k).size()*sizeof(int));
+  h = fnv_hash(h, d.X_ind.x, d.X_ind.size()*sizeof(double));
+  h = fnv_hash(h, d.ind_phi_occ.data(), d.ind_phi_occ.size()*sizeof(int));
+  h = fnv_hash(h, d.ind_p_occ.data(), d.ind_p_occ.size()*sizeof(int));
+  return h;
+}
+
+//function that returns whether two capture history data are the same (for data with the same hash, which are registered copies)
+inline bool fwd_ch_same(const fwd_ch_data &r, const fwd_ch_data &d){
+  bool same = r.n_states==d.n_states && r.nDS_OCC==d.nDS_OCC && r.n_OCC==d.n_OCC && r.n_groups==d.n_groups && r.n_phi==d.n_phi && r.n_p==d.n_p &&
+    r.n_cov==d.n_cov && r.n_set_phi==d.n_set_phi && r.n_set_p==d.n_set_p && r.X_ind.rows()==d.X_ind.rows() && 
+    (r.X_ind.mat().array()==d.X_ind.mat().array()).all() && r.ind_phi_occ.size()==d.ind_phi_occ.size() && (r.ind_phi_occ==d.ind_phi_occ).all() && 
+    r.ind_p_occ.size()==d.ind_p_occ.size() && (r.ind_p_occ==d.ind_p_occ).all() &&
+    r.CH.rows()==d.CH.rows() && r.CH.cols()==d.CH.cols() && (r.CH.mat().array()==d.CH.mat().array()).all() && 
+    (r.f.mat().array()==d.f.mat().array()).all() && (r.freq.mat().array()==d.freq.mat().array()).all() && 
+    r.Psi_pim.size()==d.Psi_pim.size() && (r.Psi_pim.mat().array()==d.Psi_pim.mat().array()).all() && 
+    r.pim_row.size()==d.pim_row.size() && (r.pim_row.mat().array()==d.pim_row.mat().array()).all() && 
+    r.chi_grp.size()==d.chi_grp.size() && (r.chi_grp==d.chi_grp).all();
+  for(int k=0; same && k<d.Phi_pim.size(); k++) same = r.Phi_pim(k).rows()==d.Phi_pim(k).rows() && (r.Phi_pim(k).mat().array()==d.Phi_pim(k).mat().array()).all();
+  for(int k=0; same && k<d.p_pim.size(); k++) same = r.p_pim(k).rows()==d.p_pim(k).rows() && (r.p_pim(k).mat().array()==d.p_pim(k).mat().array()).all();
+  return same;
+}
+
+//registry of capture history data (weak pointers by hash, and the data by id with CppAD)
+struct fwd_ch_registry_t {
+  std::unordered_map<uint64_t, std::weak_ptr<const fwd_ch_data> > by_hash;
+  std::deque<fwd_ch_ptr> by_id;
+};
+inline fwd_ch_registry_t& fwd_ch_registry(){
+  static fwd_ch_registry_t registry;
+  return registry;
+}
+
+//function that returns the capture history data at index id of the registry (CppAD)
+inline fwd_ch_ptr fwd_ch_lookup(int id){
+  fwd_ch_ptr d;
+  #pragma omp critical (fwd_ch_registry)
+  d = fwd_ch_registry().by_id[id];
+  return d;
+}
+
+//function that sets the dimensions and individual covariate settings of capture history data (see fwd_ch_register)
+inline void fwd_ch_dims(fwd_ch_data &d, int n_states, int nDS_OCC, int n_OCC, int n_groups, int n_phi, int n_p, int n_cov,
+                        vector<int> &ind_phi_occ, vector<int> &ind_p_occ, int n_set_phi, int n_set_p){
+  d.n_states=n_states; d.nDS_OCC=nDS_OCC; d.n_OCC=n_OCC; d.n_groups=n_groups; d.n_phi=n_phi; d.n_p=n_p;
+  d.n_cov=n_cov;
+  d.n_set_phi = d.n_cov>0 ? n_set_phi : 0;
+  d.n_set_p = d.n_cov>0 ? n_set_p : 0;
+  d.n_par=n_phi+n_p+n_groups*n_states+d.n_cov*(d.n_set_phi+d.n_set_p);
+  if(d.n_cov>0){
+    d.ind_phi_occ=ind_phi_occ;
+    d.ind_p_occ=ind_p_occ;
+  }
+}
+
+//function that renumbers the chi groups (chi_grp of all capture histories) of the capture histories in the data, which start at row n_from,
+//and finds their last detections
+inline void fwd_ch_chi_groups(fwd_ch_data &d, vector<int> &chi_grp, int n_from){
+  int n_rows=d.CH.rows();
+  std::map<int,int> grp;
+  std::vector<int> rows;
+  d.last.resize(n_rows);
+  d.chi_grp.resize(n_rows);
+  for(int n=0; n<n_rows; n++){
+    d.last(n)=last_detection(d.CH, n, d.f(n));
+    if(grp.find(chi_grp(n_from+n))==grp.end()){
+      grp[chi_grp(n_from+n)]=rows.size();
+      rows.push_back(n);
     }
+    d.chi_grp(n)=grp[chi_grp(n_from+n)];
+  }
+  d.chi_row.resize(rows.size());
+  for(size_t j=0; j<rows.size(); j++) d.chi_row(j)=rows[j];
+}
+
+//function that returns a view of rows from, ..., from+n_rows-1 of the individual covariates (a copy if they are not double)
+inline data_view<double> fwd_ind_view(const matrix<double> &X_ind, int from, int n_rows){
+  return data_view<double>(X_ind.data(), X_ind.rows(), X_ind.cols(), from, n_rows);
+}
+template<class Type>
+data_view<double> fwd_ind_view(const matrix<Type> &X_ind, int from, int n_rows){
+  matrix<double> X(n_rows, X_ind.cols());
+  for(int j=0; j<X.cols(); j++) for(int r=0; r<n_rows; r++) X(r,j)=asDouble(X_ind(from+r,j));
+  return data_view<double>(X);
+}
 
+//function that returns views of the data of capture histories (rows) n_from to n_to-1, for evaluating the likelihood without a tape
+//(double), so the data are not copied, hashed, or registered. The arguments are as in fwd_ch_register.
+template<class Type>
+fwd_ch_data fwd_ch_view(int n_states, int nDS_OCC, int n_OCC, int n_groups, int n_phi, int n_p, int n_from, int n_to, const ch_codes &CH, 
+                        vector<int> &f, vector<int> &freq, pim<Type> &Phi_pim, pim<Type> &p_pim, vector<int> &Psi_pim, vector<int> &chi_grp,
+                        vector<int> &pim_row, bool group_pim, matrix<Type> &X_ind, vector<int> &ind_phi_occ, vector<int> &ind_p_occ,
+                        int n_set_phi, int n_set_p){
+  int n_rows=n_to-n_from;
+  fwd_ch_data d;
+  fwd_ch_dims(d, n_states, nDS_OCC, n_OCC, n_groups, n_phi, n_p, X_ind.cols(), ind_phi_occ, ind_p_occ, n_set_phi, n_set_p);
+  d.CH=data_view<unsigned char>(CH.data(), CH.rows(), CH.cols(), n_from, n_rows);
+  d.f=data_view<int>(f.data(), f.size(), 1, n_from, n_rows);
+  d.freq=data_view<int>(freq.data(), freq.size(), 1, n_from, n_rows);
+  d.Phi_pim.resize(Phi_pim.size());
+  d.p_pim.resize(p_pim.size());
+  if(group_pim){
+    if(d.n_cov>0) d.X_ind=fwd_ind_view(X_ind, 0, X_ind.rows());
+    d.pim_row=data_view<int>(pim_row.data(), pim_row.size(), 1, n_from, n_rows);
+    d.Psi_pim=data_view<int>(Psi_pim.data(), Psi_pim.size(), 1, 0, Psi_pim.size());
+    for(int k=0; k<Phi_pim.size(); k++) d.Phi_pim(k)=Phi_pim(k);
+    for(int k=0; k<p_pim.size(); k++) d.p_pim(k)=p_pim(k);
+  }else{
+    if(d.n_cov>0) d.X_ind=fwd_ind_view(X_ind, n_from, n_rows);
+    d.Psi_pim=data_view<int>(Psi_pim.data(), Psi_pim.size(), 1, n_from, n_rows);
+    for(int k=0; k<Phi_pim.size(); k++) d.Phi_pim(k)=data_view<int>(Phi_pim(k).x, Phi_pim(k).ld, Phi_pim(k).cols(), n_from, n_rows);
+    for(int k=0; k<p_pim.size(); k++) d.p_pim(k)=data_view<int>(p_pim(k).x, p_pim(k).ld, p_pim(k).cols(), n_from, n_rows);
+  }
+  if(chi_grp.size()>0) fwd_ch_chi_groups(d, chi_grp, n_from);
+  return d;
+}
+
+//function that returns the data of capture histories (rows) n_from to n_to-1 for taping. The model is taped several times with the same data 
+//(and chunks of rows are registered separately), so if data with the same hash are still in use they are shared. chi_grp is the group 
+//of PIM rows of each capture history if the chi tables are used, or empty. pim_row is the row of the PIMs of each capture history. 
+//If group_pim, the PIMs have a row per group and are registered whole, otherwise they have a row per capture history and only rows 
+//n_from to n_to-1 are registered. X_ind (rows of the PIMs), ind_phi_occ, and ind_p_occ are the individual covariates, whose phi and p
+//coefficients have n_set_phi and n_set_p columns.
+template<class Type>
+fwd_ch_ptr fwd_ch_register(int n_states, int nDS_OCC, int n_OCC, int n_groups, int n_phi, int n_p, int n_from, int n_to, const ch_codes &CH, 
+                           vector<int> &f, vector<int> &freq, pim<Type> &Phi_pim, pim<Type> &p_pim, vector<int> &Psi_pim, vector<int> &chi_grp,
+                           vector<int> &pim_row, bool group_pim, matrix<Type> &X_ind, vector<int> &ind_phi_occ, vector<int> &ind_p_occ,
+                           int n_set_phi, int n_set_p){
+  int n_rows=n_to-n_from;
+  std::shared_ptr<fwd_ch_data> dp = std::make_shared<fwd_ch_data>();
+  fwd_ch_data &d = *dp;
+  fwd_ch_dims(d, n_states, nDS_OCC, n_OCC, n_groups, n_phi, n_p, X_ind.cols(), ind_phi_occ, ind_p_occ, n_set_phi, n_set_p);
+  int r0 = group_pim ? 0 : n_from; // first row of the PIMs and X_ind
+  if(d.n_cov>0){
+    matrix<double> X(group_pim ? X_ind.rows() : n_rows, d.n_cov);
+    for(int j=0; j<d.n_cov; j++) for(int r=0; r<X.rows(); r++) X(r,j)=asDouble(X_ind(r0+r,j));
+    d.X_ind=data_view<double>(X);
   }
+  d.CH=data_view<unsigned char>(CH.block(n_from,0,n_rows,CH.cols()));
+  d.f=data_view<int>(f.segment(n_from,n_rows).matrix());
+  d.freq=data_view<int>(freq.segment(n_from,n_rows).matrix());
+  d.Phi_pim.resize(Phi_pim.size());
+  d.p_pim.resize(p_pim.size());
+  if(group_pim){
+    d.pim_row=data_view<int>(pim_row.segment(n_from,n_rows).matrix());
+    d.Psi_pim=data_view<int>(Psi_pim.matrix());
+    for(int k=0; k<Phi_pim.size(); k++) d.Phi_pim(k)=data_view<int>(Phi_pim(k).mat());
+    for(int k=0; k<p_pim.size(); k++) d.p_pim(k)=data_view<int>(p_pim(k).mat());
+  }else{
+    d.Psi_pim=data_view<int>(Psi_pim.segment(n_from,n_rows).matrix());
+    for(int k=0; k<Phi_pim.size(); k++) d.Phi_pim(k)=data_view<int>(Phi_pim(k).mat().block(n_from,0,n_rows,Phi_pim(k).cols()));
+    for(int k=0; k<p_pim.size(); k++) d.p_pim(k)=data_view<int>(p_pim(k).mat().block(n_from,0,n_rows,p_pim(k).cols()));
+  }
+  if(chi_grp.size()>0) fwd_ch_chi_groups(d, chi_grp, n_from);
+  d.hash=fwd_ch_hash(d);
+  
+  fwd_ch_ptr found;
+  #pragma omp critical (fwd_ch_registry)
+  {
+  fwd_ch_registry_t &registry = fwd_ch_registry();
+  std::unordered_map<uint64_t, std::weak_ptr<const fwd_ch_data> >::iterator it = registry.by_hash.find(d.hash);
+  if(it!=registry.by_hash.end()) found = it->second.lock();
+  }
+  if(found && fwd_ch_same(*found, d)) return found;
+  
+  #pragma omp critical (fwd_ch_registry)
+  {
+  fwd_ch_registry_t &registry = fwd_ch_registry();
+  for(std::unordered_map<uint64_t, std::weak_ptr<const fwd_ch_data> >::iterator it = registry.by_hash.begin(); it!=registry.by_hash.end();){
+    if(it->second.expired()) it = registry.by_hash.erase(it); else ++it; // data no longer on any tape
+  }
+  registry.by_hash[d.hash] = dp;
+#ifndef TMBAD_FRAMEWORK
+  d.id = registry.by_id.size();
+  registry.by_id.push_back(dp);
+#endif
+  }
+  return dp;
+}
+
+//function that fills in the transition matrix T (column is state at t-1, row is state at t) and the emission probs e of the observation at 
+//occasion t, so the forward recursion is alpha_t = e*(T*alpha_t-1). Also returns the indices of phi and p for each state (-1 if not used).
+template<class Type, int K>
+void fwd_occ_matrix(const fwd_ch_data &d, int n, int t, const fwd_prob<Type> &phi, const fwd_prob<Type> &p, const Type *psi,
+                    typename fwd_types<Type,K>::mat &T, typename fwd_types<Type,K>::vec &e, 
+                    typename fwd_types<Type,K>::ivec &phi_i, typename fwd_types<Type,K>::ivec &p_i){
+  const int n_s = fwd_n_states<K>(d.n_states);
+  T.setZero();
+  e.setZero();
+  phi_i.fill(-1);
+  p_i.fill(-1);
+  int obs=d.CH(n,t);
+  int r=d.row(n); //row of the PIMs
+  T(0,0)=Type(1);  //dead stay dead
+  e(0)=Type(obs==0); //dead are not observed
+  if(t<d.nDS_OCC){ //downstream migration (only state 1)
+    phi_i(1)=phi.index(0,r,t);
+    T(0,1)=phi.c(0,r,t);
+    T(1,1)=phi(0,r,t);
+    p_i(1)=p.index(0,r,t);
+    e(1)= obs ? p(0,r,t) : p.c(0,r,t);
+  }else{
+    if(t==d.nDS_OCC){ //ocean occasion: survival, then maturation age
+      phi_i(1)=phi.index(0,r,t);
+      int g=d.Psi_pim(r);
+      Type ph=phi(0,r,t);
+      T(0,1)=phi.c(0,r,t);
+      for(int k=1; k<=n_s; k++) T(k,1)=ph*psi[g+(k-1)*d.n_groups];
+    }else{ //upstream migration
+      for(int k=1; k<=n_s; k++){
+        phi_i(k)=phi.index(k-1,r,t);
+        T(0,k)=phi.c(k-1,r,t);
+        T(k,k)=phi(k-1,r,t);
+      }
+    }
+    for(int k=1; k<=n_s; k++){ //detection probability fixed at 1 on the final occasion
+      if(t<(d.n_OCC-1)){
+        p_i(k)=p.index(k-1,r,t);
+        e(k)= (obs==0) ? p.c(k-1,r,t) : (obs==k ? p(k-1,r,t) : Type(0));
+      }else{
+        e(k)= Type(obs==k);
+      }
+    }
+  }
+}
+
+//function that fills in the odds ratios of the individual covariate effects exp(X_ind*beta) of each row of the PIMs (rows) in each of 
+//the n_set sets of occasions (columns, column major), looping over rows for each covariate (SoA)
+template<class Type>
+void fwd_ind_odds(const data_view<double> &X_ind, const Type *beta, int n_set, std::vector<Type> &E){
+  using std::exp;
+  int n_rows=X_ind.rows(), n_cov=X_ind.cols();
+  E.assign(n_rows*n_set, Type(0));
+  for(int j=0; j<n_set; j++){
+    Type *Ej=&E[j*n_rows];
+    for(int c=0; c<n_cov; c++){
+      Type b=beta[c+j*n_cov];
+      for(int r=0; r<n_rows; r++) Ej[r]+=Type(X_ind(r,c))*b;
+    }
+    for(int r=0; r<n_rows; r++) Ej[r]=exp(Ej[r]);
+  }
+}
+
+//function that adds the gradient with respect to beta of the output to dbeta, given its gradient with respect to the odds ratios E
+//of fwd_ind_odds (dE)
+template<class Type>
+void fwd_ind_odds_reverse(const data_view<double> &X_ind, const std::vector<Type> &E, const std::vector<Type> &dE, int n_set, Type *dbeta){
+  int n_rows=X_ind.rows(), n_cov=X_ind.cols();
+  for(int j=0; j<n_set; j++){
+    for(int c=0; c<n_cov; c++){
+      Type g=0;
+      for(int r=0; r<n_rows; r++) g+=Type(X_ind(r,c))*E[r+j*n_rows]*dE[r+j*n_rows];
+      dbeta[c+j*n_cov]+=g;
+    }
+  }
+}
+
+//function that calculates the frequency weighted NLL of all capture histories with the scaled forward algorithm and, if dx is 
+//not NULL, adds dy times its gradient to dx. x (and dx) are phi, p, psi (column major), and the individual covariate coefficients of phi 
+//and p (column major, if the data have individual covariates). The gradient uses the scaled backward recursion 
+//beta_t-1 = M_t'beta_t/u_t (beta_T = 1), where M_t(i,j) = e(i)*T(i,j), and d log(L)/d M_t(i,j) = beta_t(i)*alpha_t-1(j)/u_t.
+//It is written for a generic Type, so its higher derivatives are calculated with nested fwd_duals (see fwd_nll_deriv).
+//If NLL_it_vec is not NULL, fills in the log likelihood of each capture history. If the data have chi tables, the recursions stop at 
+//the last detection (beta_last = 1) and log(chi) is added, with its gradient passed back through the chi recursion once per group.
+template<class Type, int K>
+Type fwd_nll_adjoint(const fwd_ch_data &d, const Type *x, Type *dx, Type dy, Type *NLL_it_vec){
+  const int n_s = fwd_n_states<K>(d.n_states);
+  const int S = n_s+1; // number of states including dead
+  int n_OCC=d.n_OCC;
+  const Type *psi=x+d.n_phi+d.n_p;
+  const Type *beta_phi=psi+d.n_groups*d.n_states, *beta_p=beta_phi+d.n_cov*d.n_set_phi;
+  std::vector<Type> phi_c(d.n_phi), p_c(d.n_p);
+  for(int i=0; i<d.n_phi; i++) phi_c[i]=Type(1)-x[i];
+  for(int i=0; i<d.n_p; i++) p_c[i]=Type(1)-x[d.n_phi+i];
+  std::vector<Type> E_phi, E_p; // odds ratios of the individual covariate effects
+  fwd_ind_odds(d.X_ind, beta_phi, d.n_set_phi, E_phi);
+  fwd_ind_odds(d.X_ind, beta_p, d.n_set_p, E_p);
+  std::vector<Type> dE_phi(E_phi.size(), Type(0)), dE_p(E_p.size(), Type(0));
+  int n_rows=d.X_ind.rows();
+  fwd_prob<Type> phi(x, &phi_c[0], d.Phi_pim, ind_odds<Type>(E_phi.empty() ? (Type*)NULL : E_phi.data(), n_rows, 
+                     d.ind_phi_occ.data(), d.ind_phi_occ.size(), d.n_phi));
+  fwd_prob<Type> p(x+d.n_phi, &p_c[0], d.p_pim, ind_odds<Type>(E_p.empty() ? (Type*)NULL : E_p.data(), n_rows, 
+                   d.ind_p_occ.data(), d.ind_p_occ.size(), d.n_p-1));
+  Type *dphi=dx, *dp=NULL, *dpsi=NULL;
+  if(dx){
+    dp=dx+d.n_phi;
+    dpsi=dp+d.n_p;
+  }
+  std::vector<Type> alpha(S*(n_OCC+1)); // alpha(S*t + state) is the normalized state probs before occasion t
+  std::vector<Type> u(n_OCC);           // sum of probs before normalizing at each occasion
+  typename fwd_types<Type,K>::mat T(S,S);
+  typename fwd_types<Type,K>::vec e(S), v(S), b(S), b_prev(S);
+  typename fwd_types<Type,K>::ivec phi_i(S), p_i(S);
+  Type nll=0;
+  bool use_chi = d.chi_grp.size()>0;
+  int n_chi_col = n_s*(n_OCC+1);
+  std::vector<Type> chi(d.chi_row.size()*n_chi_col), dchi(chi.size(), Type(0));
+  for(int j=0; j<d.chi_row.size(); j++){
+    fwd_chi(d.row(d.chi_row(j)), n_s, d.nDS_OCC, n_OCC, d.n_groups, phi, p, psi, d.Psi_pim, &chi[j*n_chi_col]);
+  }
+  for(int n=0; n<d.CH.rows(); n++){ // loop over unique capture histories
+    int f=d.f(n);
+    int r=d.row(n);
+    int last = use_chi ? d.last(n) : n_OCC-1; // last occasion of the recursions
+    int chi_i = use_chi ? d.chi_grp(n)*n_chi_col+n_s*(last+1)+(last>=f ? d.CH(n,last) : 1)-1 : -1;
+    Type *a=&alpha[S*f];
+    for(int i=0; i<S; i++) a[i]=Type(i==1); //initialize at 0,1,0,...,0 (conditioning at capture)
+    Type ll=0, L=1;
+    //forward recursion
+    for(int t=f; t<=last; t++){
+      fwd_occ_matrix<Type,K>(d, n, t, phi, p, psi, T, e, phi_i, p_i);
+      Type *a_prev=&alpha[S*t], *a_new=&alpha[S*(t+1)];
+      u[t]=Type(0);
+      for(int i=0; i<S; i++){
+        a_new[i]=Type(0);
+        for(int j=0; j<S; j++) a_new[i]+=T(i,j)*a_prev[j];
+        a_new[i]*=e(i);
+        u[t]+=a_new[i];
+      }
+      for(int i=0; i<S; i++) a_new[i]/=u[t];
+      L*=u[t];
+      if(((t+1)%log_every==0) || (t==(n_OCC-1))){
+        ll+=log(L);
+        L=Type(1);
+      }
+    }
+    if(use_chi) ll+=log(L*chi[chi_i]);
+    nll-=ll*Type(d.freq(n));
+    if(NLL_it_vec) NLL_it_vec[n]=ll;
+    if(!dx) continue;
+    
+    //backward recursion
+    Type c=-Type(d.freq(n))*dy; // derivative of the output with respect to log(L)
+    if(use_chi) dchi[chi_i]+=c/chi[chi_i];
+    b.fill(Type(1));
+    for(int t=last; t>=f; t--){
+      fwd_occ_matrix<Type,K>(d, n, t, phi, p, psi, T, e, phi_i, p_i);
+      Type *a_prev=&alpha[S*t];
+      for(int i=0; i<S; i++){
+        v(i)=Type(0);
+        for(int j=0; j<S; j++) v(i)+=T(i,j)*a_prev[j];
+      }
+      //d output / d e(i) = c*beta(i)*v(i)/u and d output / d T(i,j) = c*beta(i)*e(i)*alpha_t-1(j)/u
+      Type cu=c/u[t];
+      for(int k=1; k<S; k++){
+        if(p_i(k)>=0){
+          if(d.CH(n,t)==0) p.grad(k-1, r, t, -cu*b(k)*v(k), dp, dE_p.data());
+          if(d.CH(n,t)==k) p.grad(k-1, r, t, cu*b(k)*v(k), dp, dE_p.data());
+        }
+        if(phi_i(k)>=0){
+          if(t==d.nDS_OCC){ //ocean occasion
+            int g=d.Psi_pim(r);
+            Type dT=-b(0)*e(0), ph=phi(0,r,t);
+            for(int s=1; s<S; s++){
+              dT+=b(s)*e(s)*psi[g+(s-1)*d.n_groups];
+              dpsi[g+(s-1)*d.n_groups]+=cu*b(s)*e(s)*ph*a_prev[1];
+            }
+            phi.grad(0, r, t, cu*dT*a_prev[1], dphi, dE_phi.data());
+          }else{
+            phi.grad(k-1, r, t, cu*(b(k)*e(k)-b(0)*e(0))*a_prev[k], dphi, dE_phi.data());
+          }
+        }
+      }
+      for(int j=0; j<S; j++){
+        b_prev(j)=Type(0);
+        for(int i=0; i<S; i++) b_prev(j)+=e(i)*T(i,j)*b(i);
+        b_prev(j)/=u[t];
+      }
+      b=b_prev;
+    }
+  }
+  if(dx){
+    for(int j=0; j<d.chi_row.size(); j++){
+      fwd_chi_reverse(d.row(d.chi_row(j)), n_s, d.nDS_OCC, n_OCC, d.n_groups, phi, p, psi, d.Psi_pim, 
+                      &chi[j*n_chi_col], &dchi[j*n_chi_col], dphi, dE_phi.data(), dp, dE_p.data(), dpsi);
+    }
+    fwd_ind_odds_reverse(d.X_ind, E_phi, dE_phi, d.n_set_phi, dpsi+d.n_groups*d.n_states);
+    fwd_ind_odds_reverse(d.X_ind, E_p, dE_p, d.n_set_p, dpsi+d.n_groups*d.n_states+d.n_cov*d.n_set_phi);
+  }
+  return nll;
+}
+
+//function that runs fwd_nll_adjoint with the parameters seeded with the directions v (one per level of nesting of T) and returns the mixed
+//derivative of the gradient in y (the gradient if T is double)
+template<class T>
+void fwd_nll_deriv_dual(const fwd_ch_data &d, const double *x, const double * const *v, double *y){
+  std::vector<T> par(d.n_par), dpar(d.n_par, T(0.0));
+  for(int i=0; i<d.n_par; i++) par[i]=fwd_dual_order<T>::seed(x[i], v, i);
+  FWD_STATES(d.n_states, fwd_nll_adjoint<T,K>(d, &par[0], &dpar[0], T(1.0), (T*)NULL))
+  for(int i=0; i<d.n_par; i++) y[i]=fwd_dual_order<T>::top(dpar[i]);
+}
+
+//function for the double precision value of fwd_nll_deriv. x is the parameters of fwd_nll_adjoint, followed by the k directions.
+inline void fwd_nll_deriv_double(const fwd_ch_data &d, int k, const double *x, double *y){
+  const double *v[fwd_max_order] = {NULL};
+  for(int j=0; j<k && j<fwd_max_order; j++) v[j]=x+(j+1)*d.n_par;
+  switch(k){
+    case -1: FWD_STATES(d.n_states, y[0]=fwd_nll_adjoint<double,K>(d, x, (double*)NULL, 0.0, (double*)NULL))
+             break;
+    case 0: fwd_nll_deriv_dual<double>(d, x, v, y); break;
+    case 1: fwd_nll_deriv_dual<fwd_dual<double> >(d, x, v, y); break;
+    case 2: fwd_nll_deriv_dual<fwd_dual<fwd_dual<double> > >(d, x, v, y); break;
+    case 3: fwd_nll_deriv_dual<fwd_dual<fwd_dual<fwd_dual<double> > > >(d, x, v, y); break;
+    default: error("derivatives of order %d of the capture history likelihood are not implemented (the highest is %d)", k+1, fwd_max_order+1);
+  }
+}
+
+//function that returns the frequency weighted NLL of the capture histories (k = -1), or the derivative of its gradient with respect to 
+//the parameters of fwd_nll_adjoint in the k directions following them in x (k = 0 is the gradient), in double precision
+inline CppAD::vector<double> fwd_nll_deriv(const fwd_ch_ptr &d, int k, const CppAD::vector<double> &x){
+  CppAD::vector<double> y(k<0 ? 1 : d->n_par);
+  fwd_nll_deriv_double(*d, k, &x[0], &y[0]);
+  return y;
+}
+
+#ifdef TMBAD_FRAMEWORK
+CppAD::vector<TMBad::ad_aug> fwd_nll_deriv(const fwd_ch_ptr &d, int k, const CppAD::vector<TMBad::ad_aug> &x);
+#else
+template<class Type>
+CppAD::vector<Type> fwd_nll_deriv(const fwd_ch_ptr &d, int k, const CppAD::vector<Type> &x);
+#endif
+
+//function for the reverse pass of fwd_nll_deriv. Output k is the (k+1)-th derivative of the NLL in directions v_1, ..., v_k, so its
+//derivative with respect to the parameters in direction py is output k+1 with py as direction k+1, and with respect to v_j it is output k
+//with v_j replaced by py. The reverse pass is made of the same atomic function, so the tape of each order of derivatives (e.g., the
+//Hessian in the Laplace approximation) has one node for the likelihood, however many capture histories there are.
+template<class Type>
+void fwd_nll_deriv_reverse(const fwd_ch_ptr &d, int k, const CppAD::vector<Type> &x, const CppAD::vector<Type> &py, CppAD::vector<Type> &px){
+  int n_par=d->n_par;
+  if(k<0){
+    CppAD::vector<Type> g=fwd_nll_deriv(d, 0, x);
+    for(int i=0; i<n_par; i++) px[i]=py[0]*g[i];
+    return;
+  }
+  CppAD::vector<Type> x_next(x.size()+n_par);
+  for(size_t i=0; i<x.size(); i++) x_next[i]=x[i];
+  for(int i=0; i<n_par; i++) x_next[x.size()+i]=py[i];
+  CppAD::vector<Type> g=fwd_nll_deriv(d, k+1, x_next);
+  for(int i=0; i<n_par; i++) px[i]=g[i];
+  for(int j=1; j<=k; j++){
+    CppAD::vector<Type> x_j(x);
+    for(int i=0; i<n_par; i++) x_j[j*n_par+i]=py[i];
+    g=fwd_nll_deriv(d, k, x_j);
+    for(int i=0; i<n_par; i++) px[j*n_par+i]=g[i];
+  }
+}
+
+#ifdef TMBAD_FRAMEWORK
+//operator for fwd_nll_deriv on a TMBad tape, which holds the capture history data (so they are freed with the tape)
+struct fwd_nll_op : TMBad::global::DynamicInputOutputOperator {
+  typedef TMBad::global::DynamicInputOutputOperator Base;
+  fwd_ch_ptr d;
+  int k;
+  fwd_nll_op(const fwd_ch_ptr &d, int k, TMBad::Index n, TMBad::Index m) : Base(n,m), d(d), k(k) {}
+  const char *op_name() {return "fwd_nll_op";}
+  void forward(TMBad::ForwardArgs<TMBad::Scalar> &args){
+    std::vector<double> x(this->input_size()), y(this->output_size());
+    for(size_t i=0; i<x.size(); i++) x[i]=args.x(i);
+    fwd_nll_deriv_double(*d, k, &x[0], &y[0]);
+    for(size_t i=0; i<y.size(); i++) args.y(i)=y[i];
+  }
+  void forward(TMBad::ForwardArgs<TMBad::Replay> &args){
+    CppAD::vector<TMBad::Replay> x(this->input_size());
+    for(size_t i=0; i<x.size(); i++) x[i]=args.x(i);
+    CppAD::vector<TMBad::Replay> y=fwd_nll_deriv(d, k, x);
+    for(size_t i=0; i<y.size(); i++) args.y(i)=y[i];
+  }
+  template<class Type>
+  void reverse(TMBad::ReverseArgs<Type> &args){
+    CppAD::vector<Type> x(this->input_size()), py(this->output_size()), px(this->input_size());
+    for(size_t i=0; i<x.size(); i++) x[i]=args.x(i);
+    for(size_t i=0; i<py.size(); i++) py[i]=args.dy(i);
+    fwd_nll_deriv_reverse(d, k, x, py, px);
+    for(size_t i=0; i<px.size(); i++) args.dx(i)+=px[i];
+  }
+  void forward(TMBad::ForwardArgs<TMBad::Writer> &args){TMBAD_ASSERT(false);}
+  void reverse(TMBad::ReverseArgs<TMBad::Writer> &args){TMBAD_ASSERT(false);}
 };
 
+//fwd_nll_deriv on the tape being recorded
+CppAD::vector<TMBad::ad_aug> fwd_nll_deriv(const fwd_ch_ptr &d, int k, const CppAD::vector<TMBad::ad_aug> &x){
+  TMBad::Index n=x.size(), m=(k<0 ? 1 : d->n_par);
+  CppAD::vector<TMBad::ad_aug> y(m);
+  bool all_constant=true;
+  for(size_t i=0; i<x.size(); i++) all_constant &= x[i].constant();
+  if(all_constant){
+    CppAD::vector<double> xd(n);
+    for(size_t i=0; i<xd.size(); i++) xd[i]=x[i].Value();
+    CppAD::vector<double> yd=fwd_nll_deriv(d, k, xd);
+    for(size_t i=0; i<yd.size(); i++) y[i]=yd[i];
+  }else{
+    TMBad::OperatorPure *pOp=TMBad::get_glob()->getOperator<fwd_nll_op>(d, k, n, m);
+    std::vector<TMBad::ad_plain> xp(n);
+    for(size_t i=0; i<xp.size(); i++) xp[i]=x[i];
+    std::vector<TMBad::ad_plain> yp=TMBad::get_glob()->add_to_stack<fwd_nll_op>(pOp, xp);
+    for(size_t i=0; i<yp.size(); i++) y[i]=yp[i];
+  }
+  return y;
+}
+#else
+//function for the double precision value of fwd_nll_atomic. tx is the registry index of the capture history data and k, then x of fwd_nll_deriv.
+inline void fwd_nll_atomic_double(const CppAD::vector<double> &tx, CppAD::vector<double> &ty){
+  fwd_ch_ptr d=fwd_ch_lookup(CppAD::Integer(tx[0]));
+  fwd_nll_deriv_double(*d, CppAD::Integer(tx[1]), &tx[0]+2, &ty[0]);
+}
+
+//function for the reverse pass of fwd_nll_atomic
+template<class Type>
+void fwd_nll_atomic_reverse(const CppAD::vector<Type> &tx, const CppAD::vector<Type> &py, CppAD::vector<Type> &px){
+  fwd_ch_ptr d=fwd_ch_lookup(CppAD::Integer(tx[0]));
+  CppAD::vector<Type> x(tx.size()-2), px_x(tx.size()-2);
+  for(size_t i=0; i<x.size(); i++) x[i]=tx[i+2];
+  fwd_nll_deriv_reverse(d, CppAD::Integer(tx[1]), x, py, px_x);
+  px[0]=Type(0);
+  px[1]=Type(0);
+  for(size_t i=0; i<x.size(); i++) px[i+2]=px_x[i];
+}
+
+//atomic function for fwd_nll_deriv, so the AD tape holds one node for the likelihood of all capture histories rather than the 
+//operations for every capture history x occasion
+TMB_ATOMIC_VECTOR_FUNCTION(
+  // ATOMIC_NAME
+  fwd_nll_atomic
+  ,
+  // OUTPUT_DIM
+  (CppAD::Integer(tx[1])<0 ? 1 : fwd_ch_lookup(CppAD::Integer(tx[0]))->n_par)
+  ,
+  // ATOMIC_DOUBLE
+  fwd_nll_atomic_double(tx, ty);
+  ,
+  // ATOMIC_REVERSE
+  fwd_nll_atomic_reverse(tx, py, px);
+)
+
+//fwd_nll_deriv on the tape being recorded
+template<class Type>
+CppAD::vector<Type> fwd_nll_deriv(const fwd_ch_ptr &d, int k, const CppAD::vector<Type> &x){
+  CppAD::vector<Type> tx(x.size()+2);
+  tx[0]=Type(d->id);
+  tx[1]=Type(k);
+  for(size_t i=0; i<x.size(); i++) tx[i+2]=x[i];
+  return fwd_nll_atomic(tx);
+}
+#endif
+
 
 //Objective funtion
 
+//function that returns the column of the expected and simulated detections of SIMULATE (det, sim_det) of adult return state k at
+//occasion t, with a column for each occasion of state 1 followed by blocks of n_OCC-nDS_OCC columns (ocean and upstream occasions)
+//for states 2, ..., n_states
+inline int sim_col(int k, int t, int nDS_OCC, int n_OCC){
+  return k==1 ? t : n_OCC+(k-2)*(n_OCC-nDS_OCC)+t-nDS_OCC;
+}
+
+//function that draws a binomial(size, prob) count in SIMULATE from the counter-based random numbers (see ctr_rng.hpp) of draw slot 
+//of cohort n in replicate r, with the key of the simulation. Increments slot, so each draw of a cohort has its own stream (in the
+//same order as draw_detections in ft_engine.cpp).
+template<class Type>
+Type sim_rbinom(Type size, Type prob, uint64_t key, int r, int n, uint32_t &slot){
+  ctr_rng rng(key, r, n, slot++);
+  return Type(double(ctr_rbinom((long)asDouble(size), asDouble(prob), rng)));
+}
+
 template<class Type>
 Type objective_function<Type>::operator() ()
 {
@@ -368,15 +1618,20 @@ DATA_INTEGER(n_states);      //number of possible adult return ages
 DATA_INTEGER(n_groups);      //number groups (i.e., unique combos of LH,stream,downstream,year). Used in psi mlogit backtransform
 DATA_INTEGER(n_unique_CH);   //number of unique capture occasions
 DATA_IVECTOR(f);             //release occasion
+DATA_INTEGER(lik_engine);    //engine used to calculate the capture history likelihood (see valid_likEngine)
+DATA_IVECTOR(chunk_start);   //first row of each chunk of capture histories (plus n_unique_CH) for parallel evaluation, or empty
 
 
 //CH data
-DATA_IMATRIX(CH);           //capture histories (excluding occasion at marking (which we are conditioning on))
+DATA_STRUCT(CH, ch_matrix); //capture histories (excluding occasion at marking (which we are conditioning on)), as 1 byte codes
 DATA_IVECTOR(freq);         //frequency of capture histories
 //design matrices fixed effects
 DATA_MATRIX(X_phi);        //fixed effect design matrix for phi
 DATA_MATRIX(X_p);          // fixed effect design matrix for p
 DATA_MATRIX(X_psi);        // fixed effect design matrix for psi
+DATA_SPARSE_MATRIX(XS_phi); //sparse fixed effect design matrix for phi (used if X_phi is 0 x 0)
+DATA_SPARSE_MATRIX(XS_p);   //sparse fixed effect design matrix for p (used if X_p is 0 x 0)
+DATA_SPARSE_MATRIX(XS_psi); //sparse fixed effect design matrix for psi (used if X_psi is 0 x 0)
 //design matrices random effects
 DATA_SPARSE_MATRIX(Z_phi); //random effect design matrix for phi
 DATA_SPARSE_MATRIX(Z_p);   //random effect design matrix for p
@@ -385,16 +1640,23 @@ DATA_SPARSE_MATRIX(Z_psi); //random effect design matrix for psi
 DATA_STRUCT(Phi_pim, pim); //index vector of matrices for phi parameter vector for a given Ch x occasion
 DATA_STRUCT(p_pim, pim);   //index vector of matrices for p parameter vector for a given Ch x occasion
 DATA_IVECTOR(Psi_pim);
+DATA_IVECTOR(pim_row);      //row of Phi_pim, p_pim, and Psi_pim of each capture history, where the PIMs have a row per group of capture 
+                            //histories with the same parameters, or empty if the PIMs have a row per capture history
+//individual covariates
+DATA_MATRIX(X_ind);         //exact individual covariates (columns, e.g., length and release day) of each row of the PIMs, or 0 columns
+DATA_IVECTOR(ind_phi_occ);  //column of beta_ind_phi used at each occasion, or -1 if phi has no individual effects at the occasion
+DATA_IVECTOR(ind_p_occ);    //column of beta_ind_p used at each occasion, or -1 if p has no individual effects at the occasion
 // Covariance structures 
 DATA_STRUCT(phi_terms, terms_t);//  Covariance structure for the Phi model
 DATA_STRUCT(p_terms, terms_t);  //  Covariance structure for the p model
 DATA_STRUCT(psi_terms, terms_t);//  Covariance structure for the Psi model
 // for simulation
 DATA_IVECTOR(n_released);   // number of fish released in each cohort (LH x stream x year)
-DATA_IMATRIX(phi_pim_sim);  // index of phi parameters for the simulation 
-DATA_IMATRIX(p_pim_sim);    // index of p parameters for the simulation 
-DATA_IVECTOR(psi_pim_sim);  // index of psi parameters for the simulation 
+DATA_STRUCT(phi_pim_sim, index_view);  // index of phi parameters for the simulation 
+DATA_STRUCT(p_pim_sim, index_view);    // index of p parameters for the simulation 
+DATA_STRUCT(psi_pim_sim, index_view);  // index of psi parameters for the simulation 
 DATA_INTEGER(sim_rand);     //flag indicating whether to simulate the random effects in simulations
+DATA_INTEGER(n_reps);       //number of replicate data sets simulated in each simulation (see sim_det_reps)
 DATA_IVECTOR(f_rel);        // occasion of release for each cohort
 
   
@@ -412,6 +1674,9 @@ DATA_IVECTOR(f_rel);        // occasion of release for each cohort
   PARAMETER_VECTOR(log_pen_sds_phi);   //penalty log SDs
   PARAMETER_VECTOR(log_pen_sds_p);   //penalty log SDs
   PARAMETER_VECTOR(log_pen_sds_psi);   //penalty log SDs
+  
+  PARAMETER_MATRIX(beta_ind_phi);  //phi individual covariate coefficients (covariates x sets of occasions)
+  PARAMETER_MATRIX(beta_ind_p);    //p individual covariate coefficients (covariates x sets of occasions)
   //random effects
   PARAMETER_VECTOR(b_phi);      //phi random effects
   PARAMETER_VECTOR(b_p);        //p random effects
@@ -436,6 +1701,9 @@ DATA_IVECTOR(f_rel);        // occasion of release for each cohort
   // Joint negative log-likelihood
   parallel_accumulator<Type> jnll(this);
   
+  // AD tape used by each section of the objective function (see valid_tapeSection)
+  tape_accountant<Type> tape_acc;
+  
   
   //implicit uniform priors
   // if(do_tmbstan){
@@ -446,31 +1714,35 @@ DATA_IVECTOR(f_rel);        // occasion of release for each cohort
   // }
   
 //concatenate intercepts and penalized coefficient
-vector<Type> beta_phi(X_phi.cols()); 
+vector<Type> beta_phi(beta_phi_ints.size()+beta_phi_pen.size()); 
 beta_phi << beta_phi_ints,beta_phi_pen;
-vector<Type> beta_p(X_p.cols());
+vector<Type> beta_p(beta_p_ints.size()+beta_p_pen.size());
 beta_p << beta_p_ints,beta_p_pen;
-vector<Type> beta_psi(X_psi.cols());
+vector<Type> beta_psi(beta_psi_ints.size()+beta_psi_pen.size());
 beta_psi << beta_psi_ints,beta_psi_pen;
+tape_acc.mark(linpred_section);
 ADREPORT(beta_phi);
 ADREPORT(beta_p);
 ADREPORT(beta_psi);
+tape_acc.mark(report_section);
 
 
   // Linear predictors
   //// Fixed component
-  vector<Type> eta_phi_fixed = X_phi*beta_phi;
-  vector<Type> eta_p_fixed = X_p*beta_p;
-  vector<Type> eta_psi_fixed = X_psi*beta_psi;
+  vector<Type> eta_phi_fixed = fixed_eta(X_phi,XS_phi,beta_phi);
+  vector<Type> eta_p_fixed = fixed_eta(X_p,XS_p,beta_p);
+  vector<Type> eta_psi_fixed = fixed_eta(X_psi,XS_psi,beta_psi);
   // ADREPORT(eta_phi_fixed);
   // ADREPORT(eta_p_fixed);
   //// Random component
   vector<Type> eta_phi = eta_phi_fixed + Z_phi*b_phi;
   vector<Type> eta_p = eta_p_fixed + Z_p*b_p;
   vector<Type> eta_psi = eta_psi_fixed + Z_psi*b_psi;
+  tape_acc.mark(linpred_section);
    ADREPORT(eta_phi);
    ADREPORT(eta_p);
    // ADREPORT(eta_psi);
+  tape_acc.mark(report_section);
 
   // Apply link
   vector<Type> phi=invlogit(eta_phi);
@@ -479,14 +1751,22 @@ ADREPORT(beta_psi);
   p.tail(1)=Type(0);
   REPORT(phi);
   REPORT(p);
+  //complements, calculated once here rather than for every capture history x occasion that references them
+  vector<Type> phi_c = Type(1)-phi; // prob of dying
+  vector<Type> p_c = Type(1)-p;     // prob of not being detected
+  // Individual covariates. When X_ind has columns, phi and p at the occasions with individual effects differ between rows of the 
+  // PIMs. Their odds ratios relative to the group-level phi and p (which are still reported and simulated from) are calculated 
+  // here, and the engines apply them where they use phi and p (see ind_odds and fwd_prob).
+  matrix<Type> E_phi = ind_odds_ratio(X_ind, beta_ind_phi);
+  matrix<Type> E_p = ind_odds_ratio(X_ind, beta_ind_p);
+  fwd_prob<Type> phi_prob(phi.data(), phi_c.data(), Phi_pim, ind_odds<Type>(E_phi.size() ? E_phi.data() : (Type*)NULL, E_phi.rows(), 
+                          ind_phi_occ.data(), ind_phi_occ.size(), phi.size()));
+  fwd_prob<Type> p_prob(p.data(), p_c.data(), p_pim, ind_odds<Type>(E_p.size() ? E_p.data() : (Type*)NULL, E_p.rows(), 
+                        ind_p_occ.data(), ind_p_occ.size(), p.size()-1));
   ////phi inverse multinomial logit
-  matrix<Type> psi(n_groups,n_states);
-  eta_psi= exp(eta_psi);
-  vector<Type> denom = eta_psi.segment(0,n_groups)+eta_psi.segment(n_groups,n_groups)+Type(1);
-  psi.col(0)= eta_psi.segment(0,n_groups)/denom;        //return after 1 year
-  psi.col(1)= Type(1)/denom;                            //return after 2 year
-  psi.col(2)= eta_psi.segment(n_groups,n_groups)/denom; //return after 3 year
+  matrix<Type> psi = psi_mlogit(eta_psi, n_groups, n_states); //columns are return after 1, 2, ..., n_states years
   REPORT(psi);
+  tape_acc.mark(linpred_section);
 
   //~~~~~~~~~~~~~~~~~~~
   // Likelihood and penelties/priors
@@ -526,104 +1806,175 @@ ADREPORT(beta_psi);
   
   
   // Random effect probabilities (allterms_nll returns the nll and also simulates new values of the random effects)
+  tape_acc.mark(prior_section);
   jnll += allterms_nll(b_phi, theta_phi, phi_terms, this->do_simulate, pen_rand_phi);//);//phi
+  tape_acc.mark(re_phi_section);
   jnll += allterms_nll(b_p, theta_p, p_terms, this->do_simulate,pen_rand_p);//);//p
+  tape_acc.mark(re_p_section);
   jnll += allterms_nll(b_psi, theta_psi, psi_terms, this->do_simulate, pen_rand_psi);//);//psi
+  tape_acc.mark(re_psi_section);
   
   
   
   //Variables for foreward algorithm to calculate likelhood of capture histories
-  vector<Type> pS(4); //state probs: dead, 1, 2, 3
+  vector<Type> pS(n_states+1); //state probs: dead, 1, ..., n_states
   Type u = 0;         // holds the sum of probs after each occasion
   Type NLL_it=0;      // holds the NLL for each CH
-  Type tmp = 0;       // holds the prob of a given state during observation process in upstream migration
+  Type L=1;           // running product of u since the last log was added to NLL_it
 
   vector<Type> NLL_it_vec(n_unique_CH); // holds likelihood of each unique CH
   
-  for(int n=0; n<n_unique_CH; n++){ // loop over individual unique capture histories
-    pS.setZero(); //initialize at 0,1,0,0 (conditioning at capture)
-    pS(1)=Type(1);
-    NLL_it=Type(0); //initialize capture history NLL at 0
-
-  //downstream migration
-  for(int t=f(n); t<nDS_OCC; t++){       //loop over downstream occasions (excluding capture occasion)
-    //survival process
-    pS(0) += Type((Type(1)-phi(Phi_pim(0)(n,t)))*pS(1)); //prob die or stay dead
-    pS(1) *= Type(phi(Phi_pim(0)(n,t))); //prob stay alive
-
-    //observation process
-    pS(1) *= Type(p(p_pim(0)(n,t))*CH(n,t)+ (Type(1)-p(p_pim(0)(n,t)))*(Type(1)-CH(n,t))); //prob observation given alive
-    pS(0) *= Type(Type(1)-CH(n,t)); //prob observation given dead
-    //acculate NLL
-    u = pS.sum();  //sum of probs
-    pS = pS/u; //normalize probs
-    NLL_it  +=log(u);    //accumulate nll
-  }
-
-  //ocean occasion
-  int t = nDS_OCC;  //set occasion to be ocean occasion
-  ////survival process
-  pS(0) += Type((Type(1)-phi(Phi_pim(0)(n,t)))*pS(1)); //prob die or stay dead in ocean
-  pS(1) *= Type(phi(Phi_pim(0)(n,t))); //prob survive ocean
-  //maturation age process
-  pS(2) = pS(1) * psi(Psi_pim(n),1);
-  pS(3) = pS(1) * psi(Psi_pim(n),2);
-  pS(1) *= psi(Psi_pim(n),0);
-  
-  
-  for(int t=(nDS_OCC+1); t<n_OCC; t++){       //loop over upstream occasions  
-  
-  ////observation process at t-1 (Obs_t below), because I'm going to fix the detection prob at 1 for the last occasion after this loop
-  int Obs_t=t-1;
-  if(!CH(n,Obs_t)){
-  pS(1) *= Type(Type(1)-p(p_pim(0)(n,Obs_t)));
-  pS(2) *= Type(Type(1)-p(p_pim(1)(n,Obs_t)));
-  pS(3) *= Type(Type(1)-p(p_pim(2)(n,Obs_t)));
-  } else{
-    tmp=Type(pS(CH(n,Obs_t))*p(p_pim((CH(n,Obs_t)-1))(n,Obs_t)));
-    pS.setZero();
-    pS(CH(n,Obs_t))=tmp;
-  }
-  //accumlate NLL
-  u = pS.sum();  //sum of probs
-  pS = pS/u; //normalize probs
-  NLL_it  +=log(u);    //accumulate nll
-  //end ocean occasion
-
-  //upstream migration
-    ////survival process at time t
-    pS(0) += Type((Type(1)-phi(Phi_pim(0)(n,t)))*pS(1))+
-      Type((Type(1)-phi(Phi_pim(1)(n,t)))*pS(2))+
-      Type((Type(1)-phi(Phi_pim(2)(n,t)))*pS(3));  // sum(prob vec * 1, 1-phi_1, 1-phi_2, 1-phi_3)
-    pS(1) *= Type(phi(Phi_pim(0)(n,t)));                 // sum(prob vec * 0,   phi_1,       0,       0)
-    pS(2) *=  Type(phi(Phi_pim(1)(n,t)));                 // sum(prob vec * 0,       0,   phi_2,       0)
-    pS(3) *=  Type(phi(Phi_pim(2)(n,t)));                 // sum(prob vec * 0,       0,       0,   phi_3)
-
+  bool group_pim = pim_row.size()>0;
+  vector<int> ch_pim(n_unique_CH); //row of the PIMs of each CH
+  if(group_pim){
+    ch_pim = pim_row;
+  }else{
+    for(int n=0; n<n_unique_CH; n++) ch_pim(n)=n;
   }
   
-    
-    ////observation process at final time assuming detection probability is 1
-    if(!CH(n,(n_OCC-1))){
-      pS(1) =  Type(0);
-      pS(2) =  Type(0);
-      pS(3) =  Type(0);
-    }else{
-      tmp=pS(CH(n,(n_OCC-1)));
-      pS.setZero();
-      pS(CH(n,(n_OCC-1)))=tmp;
+  // Capture histories are evaluated in chunks. When chunk_start is given (see make_chunks in R), each chunk is a block of 
+  // capture histories of about equal cost that is taped by one thread (a parallel region), rather than spreading single 
+  // capture histories over threads with jnll. The NLL of the chunks taped by a thread is summed in lik_nll, which is added
+  // to the jnll returned by each thread.
+  bool chunked = chunk_start.size()>0;
+  int n_chunks = chunked ? chunk_start.size()-1 : 1;
+  vector<int> chunk_from(n_chunks+1);
+  if(chunked){
+    chunk_from=chunk_start;
+  }else{
+    chunk_from << 0, n_unique_CH;
+  }
+  Type lik_nll=0;
+  
+  // Most capture histories end in a run of 0s. When use_chi=1, the forward algorithm of each capture history stops at its last 
+  // detection (or release) and multiplies by the probability of never being detected again (chi), which is calculated once per
+  // group of capture histories with the same rows of the PIMs (see fwd_chi). Used by the ch and atomic engines.
+  DATA_INTEGER(use_chi);
+  DATA_IVECTOR(chi_grp); // group of each capture history (0 based), or empty if use_chi=0
+  DATA_IVECTOR(chi_row); // a capture history in each group (row of PIMs to use)
+  int n_chi_col = n_states*(n_OCC+1);
+  vector<Type> chi_tab(0);
+  // the ch engine also runs for other engines without their own branch below (e.g., the AD tape of the batch engine)
+  bool ch_fallback = lik_engine!=trie_engine && lik_engine!=atomic_engine && !(lik_engine==batch_engine && isDouble<Type>::value);
+  if(use_chi && ch_fallback){
+    chi_tab.resize(chi_row.size()*n_chi_col);
+    for(int j=0; j<chi_row.size(); j++){
+      fwd_chi(ch_pim(chi_row(j)), n_states, nDS_OCC, n_OCC, n_groups, phi_prob, p_prob, &psi(0,0), Psi_pim, chi_tab.data()+j*n_chi_col);
     }
-    //accumulate NLL
-  u = pS.sum();  //sum of probs
-  pS = pS/u; //normalize probs
-  NLL_it  +=log(u);    //accumulate nll
-  //end observation process at final time
+  }
+  vector<int> no_chi(0);
+  
+  if(lik_engine==trie_engine){
+  // Capture histories within a group (same rows of the PIMs) are arranged in a prefix trie, where each node is a
+  // unique group x sequence of observations up to an occasion. Forward probabilities and log(u) are calculated once
+  // per node and the log(u) is weighted by the summed frequency of all capture histories passing through the node.
+  DATA_IVECTOR(trie_parent); // index of parent node (-1 for the first occasion after release). Parents come before their children.
+  DATA_IVECTOR(trie_occ);    // occasion of the observation at each node
+  DATA_IVECTOR(trie_obs);    // observed state at each node
+  DATA_IVECTOR(trie_row);    // a capture history passing through each node (row of PIMs to use)
+  DATA_IVECTOR(trie_freq);   // summed frequency of capture histories passing through each node
+  DATA_IVECTOR(trie_leaf);   // node at the final occasion of each capture history
+  DATA_IVECTOR(trie_start);  // first node of each chunk of capture histories (a trie per chunk), and the number of nodes
+  
+  int n_nodes = trie_parent.size();
+  vector<Type> NLL_node(n_nodes);  // log likelihood of the observations from release up to the last log at each node
+  NLL_node.setZero(); // nodes of chunks taped by other threads
+  
+  for(int c=0; c<n_chunks; c++){ // loop over chunks of capture histories
+    if(chunked && !this->parallel_region()) continue; // chunk is taped by another thread
+    FWD_STATES(n_states, 
+      fwd_trie<Type,K>(trie_start(c), trie_start(c+1), n_states, nDS_OCC, n_OCC, trie_parent, trie_occ, trie_obs, trie_row, trie_freq,
+                       ch_pim, phi_prob, p_prob, psi, Psi_pim, NLL_node, chunked, lik_nll, jnll))
+  }
+  for(int n=0; n<n_unique_CH; n++){
+    NLL_it_vec(n)=NLL_node(trie_leaf(n));
+  }
+  
+  }else if(lik_engine==batch_engine && isDouble<Type>::value){ //the masks would only add operations to the AD tape, so the AD tape uses the ch_engine
+  
+  for(int n=0; n<n_unique_CH; n+=8){ // loop over blocks of 8 unique capture histories
+    FWD_STATES(n_states, 
+      jnll-=fwd_batch<Type,K,8>(n, n_states, nDS_OCC, n_OCC, CH, f, freq, phi_prob, p_prob, psi, Psi_pim, ch_pim, NLL_it_vec))
+  }
+  
+  }else if(lik_engine==atomic_engine){
+  
+  // parameters of the atomic function: phi, p, psi, and the individual covariate coefficients (column major), so the odds
+  // ratios of the individual covariates are calculated inside it for the rows of the PIMs in the chunk
+  bool ind = X_ind.cols()>0;
+  CppAD::vector<Type> x(phi.size()+p.size()+psi.size()+(ind ? beta_ind_phi.size()+beta_ind_p.size() : 0));
+  int i_x=0;
+  for(int i=0; i<phi.size(); i++) x[i_x++]=phi(i);
+  for(int i=0; i<p.size(); i++) x[i_x++]=p(i);
+  for(int i=0; i<psi.size(); i++) x[i_x++]=psi(i);
+  if(ind){
+    for(int i=0; i<beta_ind_phi.size(); i++) x[i_x++]=beta_ind_phi(i);
+    for(int i=0; i<beta_ind_p.size(); i++) x[i_x++]=beta_ind_p(i);
+  }
+  for(int c=0; c<n_chunks; c++){ // loop over chunks of capture histories
+    if(chunked && !this->parallel_region()) continue; // chunk is taped by another thread
+    Type chunk_nll;
+    if(isDouble<Type>::value){ // no tape, so evaluate directly on views of the data and keep the likelihood of each capture history
+      fwd_ch_data d = fwd_ch_view(n_states, nDS_OCC, n_OCC, n_groups, int(phi.size()), int(p.size()), chunk_from(c), chunk_from(c+1),
+                                  CH, f, freq, Phi_pim, p_pim, Psi_pim, use_chi ? chi_grp : no_chi, ch_pim, group_pim,
+                                  X_ind, ind_phi_occ, ind_p_occ, int(beta_ind_phi.cols()), int(beta_ind_p.cols()));
+      FWD_STATES(n_states, 
+        chunk_nll=fwd_nll_adjoint<Type,K>(d, &x[0], (Type*)NULL, Type(0), NLL_it_vec.data()+chunk_from(c)))
+    }else{ // the data are registered with the atomic function, which outlives this evaluation
+      fwd_ch_ptr d = fwd_ch_register(n_states, nDS_OCC, n_OCC, n_groups, int(phi.size()), int(p.size()), chunk_from(c), chunk_from(c+1),
+                                     CH, f, freq, Phi_pim, p_pim, Psi_pim, use_chi ? chi_grp : no_chi, ch_pim, group_pim,
+                                     X_ind, ind_phi_occ, ind_p_occ, int(beta_ind_phi.cols()), int(beta_ind_p.cols()));
+      chunk_nll=fwd_nll_deriv(d, -1, x)[0];
+    }
+    if(chunked) lik_nll+=chunk_nll; else jnll+=chunk_nll;
+  }
+  
+  }else{
+  
+  for(int c=0; c<n_chunks; c++){ // loop over chunks of capture histories
+  if(chunked && !this->parallel_region()) continue; // chunk is taped by another thread
+  for(int n=chunk_from(c); n<chunk_from(c+1); n++){ // loop over individual unique capture histories
+    const Type *chi = use_chi ? chi_tab.data()+chi_grp(n)*n_chi_col : (Type*)NULL; // chi table of the group of the CH
+    FWD_STATES(n_states, 
+      NLL_it=fwd_ch_ll<Type,K>(n, ch_pim(n), n_states, nDS_OCC, n_OCC, CH, f, phi_prob, p_prob, psi, Psi_pim, chi))
+    
+    //multiply the NLL of an individual CH by the frequency of that CH and subtract from total jnll
+    if(chunked) lik_nll-=(NLL_it*freq(n)); else jnll-=(NLL_it*freq(n));
+    NLL_it_vec(n)=NLL_it;
+  }
+  }
   
-  //multiply the NLL of an individual CH by the frequency of that CH and subtract from total jnll
-  jnll-=(NLL_it*freq(n));
-  NLL_it_vec(n)=NLL_it;
   }
   REPORT(NLL_it_vec);
+  
+  // Downstream migration is a single state CJS, so the part of each capture history from release through the last
+  // downstream detection factors into m-array cells (numbers released/detected at one occasion and next detected at a later
+  // downstream occasion). When use_marray=1, the capture histories above start at their last downstream detection
+  // (f is the occasion after it), and the m-array cells are evaluated here in closed form.
+  DATA_INTEGER(use_marray);
+  if(use_marray){
+    DATA_IVECTOR(marr_row);  // a capture history in the group of each cell
+    DATA_IVECTOR(marr_from); // occasion of release (f-1) or downstream detection
+    DATA_IVECTOR(marr_to);   // occasion of next downstream detection
+    DATA_IVECTOR(marr_freq); // number of fish in each cell
+    
+    //log probabilities, calculated once rather than for every cell x occasion that references them
+    vector<Type> log_phi = log(phi);
+    vector<Type> log_p = log(p);  // last element (fixed p=0) is -Inf, but fish are never detected there
+    vector<Type> log_p_c = log(p_c);
+    
+    for(int i=0; i<marr_freq.size(); i++){ // loop over m-array cells
+      int n=ch_pim(marr_row(i)); //row of PIMs to use
+      Type lp_cell=0; // log prob of surviving and not being detected between from and to, and being detected at to
+      for(int t=(marr_from(i)+1); t<marr_to(i); t++){
+        lp_cell += phi_prob.log_at(log_phi,0,n,t)+p_prob.log_c(log_p_c,0,n,t);
+      }
+      lp_cell += phi_prob.log_at(log_phi,0,n,marr_to(i))+p_prob.log_at(log_p,0,n,marr_to(i));
+      jnll-=(lp_cell*marr_freq(i));
+    }
+  }
   //end of likelihood
+  tape_acc.mark(lik_section);
   
   //~~~~~~~~~~~~~~~~~~~
   // Report (code copied from glmmTMB)
@@ -667,6 +2018,11 @@ ADREPORT(beta_psi);
   ADREPORT(exp(theta_phi));
   ADREPORT(exp(theta_p));
   ADREPORT(exp(theta_psi));
+  tape_acc.mark(report_section);
+  
+  // tape used by each section (rows in the order of valid_tapeSection; columns are operations, values, inputs, and bytes)
+  matrix<double> tape_sections = tape_acc.save(this->selected_parallel_region, this->max_parallel_regions);
+  REPORT(tape_sections);
   
   
   //-----------------------------------------------------------------------------
@@ -687,19 +2043,15 @@ matrix<Type> psi_hat =  psi;
 if(sim_rand){ // if(sim_rand) simulate the random effects from their hyperdistribution
     // Linear predictors
     //// Fixed component
-    eta_phi = X_phi*beta_phi;
-    eta_p = X_p*beta_p;
-    eta_psi = X_psi*beta_psi;
+    eta_phi = fixed_eta(X_phi,XS_phi,beta_phi);
+    eta_p = fixed_eta(X_p,XS_p,beta_p);
+    eta_psi = fixed_eta(X_psi,XS_psi,beta_psi);
   
 
     ///// Calculate parameters to use to calculate the expectation of the number of detections (random effects at 0)
     phi_hat=invlogit(eta_phi);
     p_hat.head(eta_p.size())=invlogit(eta_p);
-    vector<Type> eta_psi_hat= exp(eta_psi);
-    denom = eta_psi_hat.segment(0,n_groups)+eta_psi_hat.segment(n_groups,n_groups)+Type(1);
-    psi_hat.col(0)= eta_psi_hat.segment(0,n_groups)/denom;        //return after 1 year
-    psi_hat.col(1)= Type(1)/denom;                            //return after 2 year
-    psi_hat.col(2)= eta_psi_hat.segment(n_groups,n_groups)/denom; //return after 3 year
+    psi_hat = psi_mlogit(eta_psi, n_groups, n_states);
     REPORT(phi_hat);
     REPORT(p_hat);
     REPORT(psi_hat);
@@ -711,45 +2063,31 @@ if(sim_rand){ // if(sim_rand) simulate the random effects from their hyperdistri
 
     // Apply link
     phi=invlogit(eta_phi);
+    p=p_hat;
     p.head(eta_p.size())=invlogit(eta_p);
     REPORT(phi);
     REPORT(p);
     ////phi inverse multinomial logit
-    eta_psi= exp(eta_psi);
-    denom = eta_psi.segment(0,n_groups)+eta_psi.segment(n_groups,n_groups)+Type(1);
-    psi.col(0)= eta_psi.segment(0,n_groups)/denom;        //return after 1 year
-    psi.col(1)= Type(1)/denom;                            //return after 2 year
-    psi.col(2)= eta_psi.segment(n_groups,n_groups)/denom; //return after 3 year
+    psi = psi_mlogit(eta_psi, n_groups, n_states);
     REPORT(psi);
 }
 
 
 int n_cohorts = n_released.size();  // number of unique release cohorts (stream, LH, year)
+int nUS_OCC = n_OCC-nDS_OCC-1; // number of upstream occasions (the simulation PIMs have blocks of nUS_OCC columns for states 2, ..., n_states)
+int n_det_col = n_OCC+(n_states-1)*(n_OCC-nDS_OCC); // columns of detections (see sim_col)
 
 //expected detections
-matrix<Type> det_1(n_cohorts,n_OCC);        //expected detections for state 1
-matrix<Type> det_2(n_cohorts,n_OCC-nDS_OCC); //expected detections for state 2
-matrix<Type> det_3(n_cohorts,n_OCC-nDS_OCC); //expected detections for state 3
-det_1.setZero();
-det_2.setZero();
-det_3.setZero();
-
-//simulated survival and state
-matrix<Type> sim_state_1(n_cohorts,n_OCC+1);       // alive for state 1 (times a bit different to have first column represent numebr released)
-matrix<Type> sim_state_2(n_cohorts,n_OCC-nDS_OCC); // alive for state 2
-matrix<Type> sim_state_3(n_cohorts,n_OCC-nDS_OCC); // alive for state 3
+matrix<Type> det(n_cohorts,n_det_col); //expected detections for states 1, ..., n_states
+det.setZero();
 
 //simulated detections
-matrix<Type> sim_det_1(n_cohorts,n_OCC);         // detections for state 1
-matrix<Type> sim_det_2(n_cohorts,n_OCC-nDS_OCC); // detections for state 2
-matrix<Type> sim_det_3(n_cohorts,n_OCC-nDS_OCC); // detections for state 3
-sim_det_1.setZero();
-sim_det_2.setZero();
-sim_det_3.setZero();
+matrix<Type> sim_det(n_cohorts,n_det_col); // detections for states 1, ..., n_states
+//simulated detections of each replicate, with the replicates stacked by columns (i.e., cohort x state occasion x replicate arrays)
+matrix<Type> sim_det_reps(n_cohorts,n_det_col*n_reps);
 //Calculate expected detections
-int nUS_OCC = n_OCC-nDS_OCC-1; // number of upstream occasions
 for(int n=0; n<n_cohorts; n++){ // loop over release cohorts
-  pS.setZero(); //initialize at 0,1,0,0 (conditioning at capture)
+  pS.setZero(); //initialize at 0,1,0,...,0 (conditioning at capture)
   pS(1)=Type(1);
   
   //downstream migration
@@ -758,7 +2096,7 @@ for(int n=0; n<n_cohorts; n++){ // loop over release cohorts
     pS(1) *= Type(phi_hat(phi_pim_sim(n,t))); //prob stay alive
     
     //observation process
-      det_1(n,t) = Type(p_hat(p_pim_sim(n,t))*pS(1)*n_released(n)); //expected obs
+      det(n,t) = Type(p_hat(p_pim_sim(n,t))*pS(1)*n_released(n)); //expected obs
 
     
     }
@@ -770,9 +2108,8 @@ for(int n=0; n<n_cohorts; n++){ // loop over release cohorts
     pS(1) *= Type(phi_hat(phi_pim_sim(n,t))); //prob survive ocean
     
     //maturation age process
-    pS(2) = pS(1) * psi_hat(psi_pim_sim(n),1); //return prob after 2 year
-    pS(3) = pS(1) * psi_hat(psi_pim_sim(n),2); //return prob after 3 year
-    pS(1) *= psi_hat(psi_pim_sim(n),0);        //return prob after 1 year
+    Type alive = pS(1);
+    for(int k=1; k<=n_states; k++) pS(k) = alive * psi_hat(psi_pim_sim(n),k-1); //return prob after k year
     
     
     
@@ -780,45 +2117,59 @@ for(int n=0; n<n_cohorts; n++){ // loop over release cohorts
       
       ////observation process at t-1 (Obs_t below), because I'm going to fix the detection prob at 1 for the last occasion after this loop
       int Obs_t=t-1;
-      //////expected obs
-      det_1(n,Obs_t) = pS(1) * p_hat(p_pim_sim(n,Obs_t)) * n_released(n);
-      det_2(n,Obs_t-nDS_OCC) =pS(2) * p_hat(p_pim_sim(n,Obs_t+nUS_OCC)) * n_released(n);
-      det_3(n,Obs_t-nDS_OCC) =pS(3) * p_hat(p_pim_sim(n,Obs_t+nUS_OCC+nUS_OCC)) * n_released(n);
+      for(int k=1; k<=n_states; k++){
+        //////expected obs
+        det(n,sim_col(k,Obs_t,nDS_OCC,n_OCC)) = pS(k) * p_hat(p_pim_sim(n,Obs_t+(k-1)*nUS_OCC)) * n_released(n);
       
-      //upstream migration
-      ////survival process at time t
-      pS(1) *= Type(phi_hat(phi_pim_sim(n,t)));                          // sum(prob vec * 0,   phi_1,       0,       0)
-      pS(2) *=  Type(phi_hat(phi_pim_sim(n,t+nUS_OCC)));                 // sum(prob vec * 0,       0,   phi_2,       0)
-      pS(3) *=  Type(phi_hat(phi_pim_sim(n,t+nUS_OCC+nUS_OCC)));         // sum(prob vec * 0,       0,       0,   phi_3)
+        //upstream migration
+        ////survival process at time t
+        pS(k) *= Type(phi_hat(phi_pim_sim(n,t+(k-1)*nUS_OCC)));
+      }
       
     }
     
     ////observation process at final time assuming detection probability is 1
     //////expected obs
-    det_1(n,n_OCC-1) = pS(1) * n_released(n);
-    det_2(n,n_OCC-nDS_OCC-1) =pS(2)  * n_released(n);
-    det_3(n,n_OCC-nDS_OCC-1) =pS(3)  * n_released(n);
+    for(int k=1; k<=n_states; k++) det(n,sim_col(k,n_OCC-1,nDS_OCC,n_OCC)) = pS(k) * n_released(n);
     
 
 }//end loop over release cohorts
 
 
 
+//key of the counter-based random numbers of the simulation, drawn from R's random number generator once per simulate() (so
+//set.seed() reproduces it). Each draw of the binomial counts below is then counted by (replicate, cohort, draw within the cohort).
+uint64_t sim_key = ((uint64_t)(asDouble(runif(Type(0),Type(1)))*4294967296.0)<<32) | (uint64_t)(asDouble(runif(Type(0),Type(1)))*4294967296.0);
+uint32_t slot = 0;      //draw within the cohort
 Type temp = 0;          //placeholder for number surviving ocean
-Type det_surv = 0;      // placeholder for number of fish detected previously that survived (for trap dependent detection)
-Type not_det_surv = 0;  // placeholder for number of fish not detected previously that survived (for trap dependent detection)
-//Simulate data
+Type psi_rest = 0;      //placeholder for prob of returning in a state or the states after it
+vector<Type> sim_state(n_states+1); // simulated number alive in each state (dead, 1, ..., n_states) after the last occasion
+//Simulate data, n_reps times in one call so the overhead of each simulation from R (evaluating the rest of the objective function
+//and returning the report) is only paid once
+for(int r=0; r<n_reps; r++){ // loop over replicates
+if(r>0 && sim_rand){ // simulate new random effects from their hyperdistribution for each replicate
+    allterms_nll(b_phi, theta_phi, phi_terms, true, pen_rand_phi);
+    allterms_nll(b_p, theta_p, p_terms, true, pen_rand_p);
+    allterms_nll(b_psi, theta_psi, psi_terms, true, pen_rand_psi);
+    eta_phi = fixed_eta(X_phi,XS_phi,beta_phi) + Z_phi*b_phi;
+    eta_p = fixed_eta(X_p,XS_p,beta_p) + Z_p*b_p;
+    eta_psi = fixed_eta(X_psi,XS_psi,beta_psi) + Z_psi*b_psi;
+    phi=invlogit(eta_phi);
+    p.head(eta_p.size())=invlogit(eta_p);
+    psi = psi_mlogit(eta_psi, n_groups, n_states);
+}
+sim_det.setZero();
 for(int n=0; n<n_released.size(); n++){ // loop over individual release cohorts
-  pS.setZero(); //initialize at 0,1,0,0 (conditioning at capture)
-  pS(1)=Type(1);
-  sim_state_1(n,f_rel(n))=Type(n_released(n));    //initialize with number released for each CH at time 1
+  sim_state.setZero();
+  sim_state(1)=Type(n_released(n));    //initialize with number released for each CH
+  slot = 0;
   
   //downstream migration
   for(int t=f_rel(n); t<nDS_OCC; t++){       //loop over downstream occasions (excluding capture occasion)
       //survival process
-      sim_state_1(n,t+1) = rbinom(Type( sim_state_1(n,t)),phi(phi_pim_sim(n,t))); //simulated stay alive
+      sim_state(1) = sim_rbinom(Type(sim_state(1)),Type(phi(phi_pim_sim(n,t))),sim_key,r,n,slot); //simulated stay alive
       //observation process
-      sim_det_1(n,t) = rbinom(Type( sim_state_1(n,t+1)),  Type(p(p_pim_sim(n,t)))); //simulated obs
+      sim_det(n,t) = sim_rbinom(Type(sim_state(1)),  Type(p(p_pim_sim(n,t))),sim_key,r,n,slot); //simulated obs
 
     
     }
@@ -826,52 +2177,50 @@ for(int n=0; n<n_released.size(); n++){ // loop over individual release cohorts
     //ocean occasion
     int t = nDS_OCC;  //set occasion to be ocean occasion
     ////survival process
-    temp = rbinom(Type(sim_state_1(n,t)),Type(phi(phi_pim_sim(n,t)))); //simulated survive ocean
+    temp = sim_rbinom(Type(sim_state(1)),Type(phi(phi_pim_sim(n,t))),sim_key,r,n,slot); //simulated survive ocean
     
-    //maturation age simulation. rmultinomial through sequential rbinom
-    sim_state_1(n,t+1) = rbinom(Type(temp),Type(psi(psi_pim_sim(n),0)));        //simulated return after 1 year
-    sim_state_2(n,0) = rbinom(Type(temp-sim_state_1(n,t+1)),
-                Type(psi(psi_pim_sim(n),1)/(Type(1)-Type(psi(psi_pim_sim(n),0))))); //simulated return after 2 year
-    sim_state_3(n,0) = temp-sim_state_1(n,t+1)-sim_state_2(n,0);        //simulated return after 1 year
+    //maturation age simulation. rmultinomial through sequential binomials of each state given not returning in the states before it
+    for(int k=1; k<n_states; k++){
+      psi_rest = Type(0);
+      for(int j=k; j<=n_states; j++) psi_rest += psi(psi_pim_sim(n),j-1);
+      sim_state(k) = sim_rbinom(Type(temp),Type(psi(psi_pim_sim(n),k-1)/psi_rest),sim_key,r,n,slot); //simulated return after k year
+      temp -= sim_state(k);
+    }
+    sim_state(n_states) = temp; //simulated return after n_states year
     
     
     for(int t=(nDS_OCC+1); t<n_OCC; t++){       //loop over upstream occasions
       
       ////observation process at t-1 (Obs_t below), because I'm going to fix the detection prob at 1 for the last occasion after this loop
       int Obs_t=t-1;
-      //////simulated obs
-      sim_det_1(n,Obs_t) = rbinom(Type(sim_state_1(n,Obs_t+1)), Type(p(p_pim_sim(n,Obs_t))));
-      sim_det_2(n,Obs_t-nDS_OCC) = rbinom(Type(sim_state_2(n,Obs_t-nDS_OCC)),  Type(p(p_pim_sim(n,Obs_t+nUS_OCC))));
-      sim_det_3(n,Obs_t-nDS_OCC) = rbinom(Type(sim_state_3(n,Obs_t-nDS_OCC)),  Type(p(p_pim_sim(n,Obs_t+nUS_OCC+nUS_OCC))));
+      for(int k=1; k<=n_states; k++){
+        //////simulated obs
+        sim_det(n,sim_col(k,Obs_t,nDS_OCC,n_OCC)) = sim_rbinom(Type(sim_state(k)), Type(p(p_pim_sim(n,Obs_t+(k-1)*nUS_OCC))),sim_key,r,n,slot);
       
-      //upstream migration
-      ////survival simulation at time t
-      sim_state_1(n,t+1) = rbinom(Type(sim_state_1(n,t)), Type(phi(phi_pim_sim(n,t))));                                 // sum(prob vec * 0,   phi_1,       0,       0)
-      sim_state_2(n,t-nDS_OCC) = rbinom(Type(sim_state_2(n,t-nDS_OCC-1)),  Type(phi(phi_pim_sim(n,t+nUS_OCC))));                // sum(prob vec * 0,       0,   phi_2,       0)
-      sim_state_3(n,t-nDS_OCC) = rbinom(Type(sim_state_3(n,t-nDS_OCC-1)), Type(phi(phi_pim_sim(n,t+nUS_OCC+nUS_OCC))));                 // sum(prob vec * 0,       0,       0,   phi_3)
+        //upstream migration
+        ////survival simulation at time t
+        sim_state(k) = sim_rbinom(Type(sim_state(k)), Type(phi(phi_pim_sim(n,t+(k-1)*nUS_OCC))),sim_key,r,n,slot);
+      }
       
     }
     
     ////observation process at final time assuming detection probability is 1
     //////simulated obs (final occasion detection prob = 1)
-    sim_det_1(n,n_OCC-1) =  sim_state_1(n,n_OCC) ;
-    sim_det_2(n,n_OCC-nDS_OCC-1) =  sim_state_2(n,n_OCC-nDS_OCC-1);
-    sim_det_3(n,n_OCC-nDS_OCC-1) =  sim_state_3(n,n_OCC-nDS_OCC-1);
+    for(int k=1; k<=n_states; k++) sim_det(n,sim_col(k,n_OCC-1,nDS_OCC,n_OCC)) = sim_state(k);
 
 }//end loop over release cohorts
+sim_det_reps.block(0,r*n_det_col,n_cohorts,n_det_col) = sim_det;
+}//end loop over replicates
 
 ////Report simulated data and expectation
-REPORT(det_1);
-REPORT(det_2);
-REPORT(det_3);
-REPORT(sim_det_1);
-REPORT(sim_det_2);
-REPORT(sim_det_3);
+REPORT(det);
+REPORT(sim_det); //last replicate
+REPORT(sim_det_reps);
   } //end simulate
   
   
 
  
-  //return jnll
-  return(jnll);
+  //return jnll (plus the NLL of capture history chunks taped by this thread)
+  return(Type(jnll)+lik_nll);
 }